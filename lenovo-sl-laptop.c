@@ -26,6 +26,39 @@
 
 #define LENSL_LAPTOP_VERSION "0.02"
 
+/* build-time subsystem selection; the Makefile sets these to 0 when the
+   corresponding LENSL_* make variable is "n" */
+#ifndef LENSL_CONFIG_PROCFS
+#define LENSL_CONFIG_PROCFS 1
+#endif
+#ifndef LENSL_CONFIG_UWB
+#define LENSL_CONFIG_UWB 1
+#endif
+#ifndef LENSL_CONFIG_BACKLIGHT
+#define LENSL_CONFIG_BACKLIGHT 1
+#endif
+#ifndef LENSL_CONFIG_LEDS
+#define LENSL_CONFIG_LEDS 1
+#endif
+#ifndef LENSL_CONFIG_DEBUG
+#define LENSL_CONFIG_DEBUG 1
+#endif
+#ifndef LENSL_CONFIG_NETLINK
+#define LENSL_CONFIG_NETLINK 1
+#endif
+#ifndef LENSL_CONFIG_TRACE
+#define LENSL_CONFIG_TRACE 1
+#endif
+#ifndef LENSL_CONFIG_ACCEL
+#define LENSL_CONFIG_ACCEL 1
+#endif
+#ifndef LENSL_CONFIG_BATTERY
+#define LENSL_CONFIG_BATTERY 1
+#endif
+#ifndef LENSL_CONFIG_PERF
+#define LENSL_CONFIG_PERF 1
+#endif
+
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/version.h>
@@ -35,16 +68,57 @@
 #include <linux/rfkill.h>
 #include <linux/hwmon.h>
 #include <linux/hwmon-sysfs.h>
+#if LENSL_CONFIG_BACKLIGHT
 #include <linux/backlight.h>
+#endif
+#if LENSL_CONFIG_LEDS
+#include <linux/leds.h>
+#endif
 #include <linux/platform_device.h>
 
 #include <linux/input.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/delay.h>
+#if LENSL_CONFIG_BATTERY
+#include <linux/power_supply.h>
+#endif
 
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include <linux/ratelimit.h>
+
+#if LENSL_CONFIG_PROCFS
 #include <linux/proc_fs.h>
+#include <linux/poll.h>
+#endif
 #include <linux/uaccess.h>
 
+#if LENSL_CONFIG_NETLINK
+#include <net/genetlink.h>
+#endif
+
+#if LENSL_CONFIG_TRACE
+#include <linux/firmware.h>
+#include <linux/vmalloc.h>
+#endif
+
+/* perf finds the events of a named PMU in its sysfs format and events
+   directories, which the PMU provides through attr_groups since 3.4 */
+#if LENSL_CONFIG_PERF && defined(CONFIG_PERF_EVENTS) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+#define LENSL_PERF 1
+#include <linux/perf_event.h>
+#else
+#define LENSL_PERF 0
+#endif
+
+#include "lenovo-sl-laptop.h"
+
 #define LENSL_MODULE_DESC "Lenovo ThinkPad SL Series Extras driver"
 #define LENSL_MODULE_NAME "lenovo-sl-laptop"
 
@@ -62,11 +136,57 @@ MODULE_LICENSE("GPL");
 #define LENSL_INFO	6
 #define LENSL_DEBUG	7
 
+/* Debug-level output is checked through lensl_debug_on(). When the
+   driver is built with LENSL_CONFIG_DEBUG=0 it is a constant and every
+   debug-level call site compiles away. On kernels with jump labels
+   (jump_label_key from 2.6.37, static_key from 3.3) it is a static key
+   that lensl_init() enables once for debug=7, so the disabled case is a
+   patched-out branch. Older kernels have no jump labels; there the
+   debug-level messages are pr_debug()s, switched per call site through
+   dynamic_debug, and lensl_debug_on() only spares the formatting of
+   the ACPI call log when debug < 7. */
+#if !LENSL_CONFIG_DEBUG
+#define lensl_debug_on() 0
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+#include <linux/jump_label.h>
+static struct static_key lensl_debug_key = STATIC_KEY_INIT_FALSE;
+#define lensl_debug_on() static_key_false(&lensl_debug_key)
+#define lensl_debug_key_inc() static_key_slow_inc(&lensl_debug_key)
+#define lensl_debug_key_dec() static_key_slow_dec(&lensl_debug_key)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+#include <linux/jump_label.h>
+static struct jump_label_key lensl_debug_key;
+#define lensl_debug_on() static_branch(&lensl_debug_key)
+#define lensl_debug_key_inc() jump_label_inc(&lensl_debug_key)
+#define lensl_debug_key_dec() jump_label_dec(&lensl_debug_key)
+#else
+#define LENSL_DYNAMIC_DEBUG 1
+#define lensl_debug_on() unlikely(dbg_level >= LENSL_DEBUG)
+#endif
+#ifndef lensl_debug_key_inc
+#define lensl_debug_key_inc() do { } while (0)
+#define lensl_debug_key_dec() do { } while (0)
+#endif
+
+#define lensl_dbg_level_on(a_dbg_level) \
+	((a_dbg_level) < LENSL_DEBUG ? dbg_level >= (a_dbg_level) : \
+		lensl_debug_on())
+
+#ifdef LENSL_DYNAMIC_DEBUG
+#define vdbg_printk_(a_dbg_level, format, arg...) \
+	do { if ((a_dbg_level) >= LENSL_DEBUG) \
+		pr_debug(LENSL_MODULE_NAME ": " format, ## arg); \
+	else if (dbg_level >= (a_dbg_level)) \
+		printk("<" #a_dbg_level ">" LENSL_MODULE_NAME ": " \
+			format, ## arg); \
+	} while (0)
+#else
 #define vdbg_printk_(a_dbg_level, format, arg...) \
-	do { if (dbg_level >= a_dbg_level) \
+	do { if (lensl_dbg_level_on(a_dbg_level)) \
 		printk("<" #a_dbg_level ">" LENSL_MODULE_NAME ": " \
 			format, ## arg); \
 	} while (0)
+#endif
 #define vdbg_printk(a_dbg_level, format, arg...) \
 	vdbg_printk_(a_dbg_level, format, ## arg)
 
@@ -81,12 +201,18 @@ MODULE_LICENSE("GPL");
 
 #define LENSL_HKEY_POLL_KTHREAD_NAME "klensl_hkeyd"
 #define LENSL_WORKQUEUE_NAME "klensl_wq"
+#define LENSL_BACKLIGHT_WORKQUEUE_NAME "klensl_blwq"
+#define LENSL_EC_WATCH_WORKQUEUE_NAME "klensl_ecwq"
+#define LENSL_ACCEL_WORKQUEUE_NAME "klensl_accel"
 
 #define LENSL_EC0 "\\_SB.PCI0.SBRG.EC0"
 #define LENSL_HKEY LENSL_EC0 ".HKEY"
 #define LENSL_LCDD "\\_SB.PCI0.VGA.LCDD"
+#define LENSL_BAT0 LENSL_EC0 ".BAT0"
 
 #define LENSL_MAX_ACPI_ARGS 3
+/* _BCL holds percentages plus two extra values */
+#define LENSL_BCL_MAX 128
 
 /* parameters */
 
@@ -95,14 +221,26 @@ static int debug_ec;
 static int control_backlight;
 static int bluetooth_auto_enable = 1;
 static int wwan_auto_enable = 1;
-static int uwb_auto_enable = 1;
+static int watch_interval;
+static int fan_notify_rpm = 100;
+static int fan_sample_interval;
+static int fan_reg = -1;
+static int fan_write_delay = 50;
+static int ec_burst = 1;
+static int ec_budget[3]; /* interactive, telemetry, debug */
+static int radio_hotkey;
+static int fault_init;
+#if LENSL_CONFIG_PROCFS
 module_param(debug_ec, bool, S_IRUGO);
 MODULE_PARM_DESC(debug_ec,
 	"Present EC debugging interface in procfs. WARNING: writing to the "
 	"EC can hang your system and possibly damage your hardware.");
+#endif
+#if LENSL_CONFIG_BACKLIGHT
 module_param(control_backlight, bool, S_IRUGO);
 MODULE_PARM_DESC(control_backlight,
 	"Control backlight brightness; can conflict with ACPI video driver.");
+#endif
 module_param_named(debug, dbg_level, uint, S_IRUGO);
 MODULE_PARM_DESC(debug,
 	"Set debug verbosity level (0 = nothing, 7 = everything).");
@@ -114,18 +252,223 @@ module_param(wwan_auto_enable, bool, S_IRUGO);
 MODULE_PARM_DESC(wwan_auto_enable,
 	"Automatically enable WWAN (if supported by hardware) when the "
 	"module is loaded.");
+#if LENSL_CONFIG_UWB
+static int uwb_auto_enable = 1;
 module_param(uwb_auto_enable, bool, S_IRUGO);
 MODULE_PARM_DESC(wwan_auto_enable,
 	"Automatically enable UWB (if supported by hardware) when the "
 	"module is loaded.");
+#endif
+module_param(radio_hotkey, bool, S_IRUGO);
+MODULE_PARM_DESC(radio_hotkey,
+	"Bind Fn-F5 to radios_toggle at load time, so that it switches all "
+	"radios in the driver instead of reporting KEY_WLAN.");
+module_param(watch_interval, int, S_IRUGO);
+MODULE_PARM_DESC(watch_interval,
+	"Interval in ms at which the hardware radio switch and the fan are "
+	"checked for changes to notify sysfs pollers about (0 = never, the "
+	"default).");
+module_param(fan_notify_rpm, int, S_IRUGO);
+MODULE_PARM_DESC(fan_notify_rpm,
+	"Minimum change in fan speed (rpm) that wakes up fan1_input pollers.");
+module_param(ec_burst, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ec_burst,
+	"Use EC burst mode for multi-register reads and writes.");
+module_param_array(ec_budget, int, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ec_budget,
+	"EC transactions per second allowed for the interactive, telemetry "
+	"and debug classes (0 = unlimited).");
+#if LENSL_CONFIG_TRACE
+static int trace_size;
+static char *replay;
+static int simulate;
+static int sim_latency;
+module_param(trace_size, int, S_IRUGO);
+MODULE_PARM_DESC(trace_size,
+	"Record the last that many EC and ACPI accesses for "
+	"<debugfs>/lenovo-sl-laptop/trace (0 = no recording).");
+module_param(replay, charp, S_IRUGO);
+MODULE_PARM_DESC(replay,
+	"Capture file, looked up like firmware, to answer all EC and ACPI "
+	"accesses from instead of the hardware.");
+module_param(simulate, bool, S_IRUGO);
+MODULE_PARM_DESC(simulate,
+	"Run against a simulated EC and ACPI instead of the hardware.");
+module_param(sim_latency, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_latency,
+	"Busy-wait time in us of each simulated EC or ACPI access.");
+#endif
+#if LENSL_CONFIG_ACCEL
+static int accel_reg = -1;
+static int accel_rate = 25;
+static int accel_shock = 64;
+module_param(accel_reg, int, S_IRUGO);
+MODULE_PARM_DESC(accel_reg,
+	"EC register holding the accelerometer X axis, followed by Y "
+	"(16-bit little-endian each); -1 = no accelerometer.");
+module_param(accel_rate, int, S_IRUGO);
+MODULE_PARM_DESC(accel_rate,
+	"Initial accelerometer sampling rate in Hz; can be changed later "
+	"through the accel_rate attribute.");
+module_param(accel_shock, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(accel_shock,
+	"Change between two accelerometer samples (|dx| + |dy|, raw units) "
+	"reported as a shock; 0 = never.");
+#endif
+#if LENSL_CONFIG_BATTERY
+static int battery_reg = -1;
+static int battery_max_age = 1000;
+module_param(battery_reg, int, S_IRUGO);
+MODULE_PARM_DESC(battery_reg,
+	"EC register holding the battery state, followed by rate (mA), "
+	"remaining charge (mAh) and voltage (mV) as 16-bit little-endian "
+	"values; -1 = no EC battery.");
+module_param(battery_max_age, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(battery_max_age,
+	"Time in ms for which battery readings are served from the cache; "
+	"0 = read the EC every time.");
+#endif
+module_param(fan_reg, int, S_IRUGO);
+MODULE_PARM_DESC(fan_reg,
+	"EC register holding the current fan duty (0-255), used to read "
+	"back pwm1; -1 = not known.");
+module_param(fan_write_delay, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fan_write_delay,
+	"Time in ms over which pwm1 writes are collapsed into one firmware "
+	"call.");
+module_param(fan_sample_interval, int, S_IRUGO);
+MODULE_PARM_DESC(fan_sample_interval,
+	"Initial interval in ms of the fan telemetry sampler (0 = off); can "
+	"be changed later through the hwmon update_interval attribute.");
+module_param(fault_init, int, S_IRUGO);
+MODULE_PARM_DESC(fault_init,
+	"Make init step 1-19 fail, for testing error handling (see README); "
+	"0 = none.");
 
 /* general */
 
-static acpi_handle hkey_handle, ec0_handle;
 static struct platform_device *lensl_pdev;
-static struct input_dev *hkey_inputdev;
 static struct workqueue_struct *lensl_wq;
 
+typedef enum {
+	LENSL_BLUETOOTH = LENSL_RADIO_BLUETOOTH,
+	LENSL_WWAN = LENSL_RADIO_WWAN,
+#if LENSL_CONFIG_UWB
+	LENSL_UWB = LENSL_RADIO_UWB,
+#endif
+	LENSL_RADIO_COUNT,
+} lensl_radio_type;
+
+/* pretend_blocked indicates whether we pretend that the device is
+   hardware-blocked (used primarily to prevent the device from coming
+   online when the module is loaded) */
+struct lensl_radio {
+	lensl_radio_type type;
+	enum rfkill_type rfktype;
+	int present;
+	char *name;
+	char *rfkname;
+	struct rfkill *rfk;
+	int (*get_acpi)(int *);
+	int (*set_acpi)(int);
+	int *auto_enable;
+};
+
+/* Per-device state, allocated when the platform device is probed and
+   reached through lensl. Each group starts on its own cache line: the
+   hot group is read by the hotkey poller on every tick, the shared group
+   is written from sysfs, ioctl and the workers on any CPU, and the cold
+   group is set up at probe time and only changes when the firmware
+   republishes its backlight table, so writes to the shared state never
+   evict the poller's data. */
+struct lensl_priv {
+	/* hot: hotkey poll loop and every ACPI call */
+	acpi_handle hkey_handle ____cacheline_aligned_in_smp;
+	acpi_handle ec0_handle;
+	struct input_dev *hkey_inputdev;
+	struct task_struct *hkey_poll_task;
+	int hkey_poll_hz;
+	int hkey_backoff;
+	u8 hkey_ec_prev_offset;
+	struct mutex hkey_poll_mutex;
+
+	/* shared: written from any CPU; the fan state is under fan_mutex */
+	/* serializes changes of the fan state: a mode or pwm change is a
+	   DECF read and an SFNV call followed by an update of pwm1_value
+	   and fan_mode_seen, which must not interleave with another
+	   writer */
+	struct mutex fan_mutex ____cacheline_aligned_in_smp;
+	/* duty last requested, or read back from fan_reg; -1 if unknown
+	   (ACPI offers no way of reading it) */
+	int pwm1_value;
+	/* duty the firmware last took, to roll pwm1_value back to when a
+	   deferred write fails; -1 if unknown */
+	int pwm1_committed;
+	/* last fan mode we set or observed, -1 if unknown */
+	int fan_mode_seen;
+	/* last fan speed reported to pollers, -1 if unknown */
+	int fan_rpm_seen;
+	/* alarm thresholds in rpm (0 = disabled), current LENSL_FAN_ALARM_* */
+	int fan1_min, fan1_max, fan1_alarms;
+	/* lowest pwm1 value accepted in manual mode, set by the performance
+	   profile (0 = none) */
+	int fan_pwm_floor;
+	int fan_write_pending;
+	struct {
+		unsigned long requests, commits, errors;
+		unsigned long sfnv_saved, decf_saved;
+	} fan_stats;
+	/* fan telemetry ring, under fan_ring_lock */
+	struct lensl_fan_sample *fan_ring;
+	unsigned int fan_ring_head, fan_ring_count;
+	u32 fan_ring_seq;
+	spinlock_t fan_ring_lock;
+	int profile;
+	/* highest usable level in percent of the top of the backlight
+	   table; lowered by the low-power profile */
+	int backlight_cap_pct;
+	int watch_wlsw;
+	/* outcome of the last multi-radio operation, per radio */
+	struct {
+		int on;
+		int result;
+	} radios_last[LENSL_RADIO_COUNT];
+#if LENSL_CONFIG_ACCEL
+	struct input_dev *accel_inputdev;
+	struct delayed_work accel_work;
+	int accel_running;
+	struct {
+		spinlock_t lock;
+		int x, y, valid;
+		unsigned long samples, errors, shocks;
+	} accel;
+#endif
+#if defined(CONFIG_NEW_LEDS) && LENSL_CONFIG_LEDS
+	struct {
+		struct led_classdev cdev;
+		enum led_brightness brightness;
+		int supported, new_code, code;
+		struct work_struct work;
+	} led_tv;
+#endif
+
+	/* cold */
+	struct device *hwmon_device ____cacheline_aligned_in_smp;
+	acpi_handle lcdd_handle;
+	/* for _BST, NULL without an EC battery or with virtual firmware */
+	acpi_handle bat0_handle;
+	struct lensl_bcl *backlight_levels;
+	int backlight_notify_installed;
+#if LENSL_CONFIG_BACKLIGHT
+	struct backlight_device *backlight;
+#endif
+	struct lensl_radio radios[LENSL_RADIO_COUNT];
+};
+
+static struct lensl_priv *lensl;
+
+static void lensl_event(int event, int index, int value);
+
 static int parse_strtoul(const char *buf,
 		unsigned long max, unsigned long *value)
 {
@@ -139,1281 +482,5568 @@ static int parse_strtoul(const char *buf,
 	return 0;
 }
 
-static int lensl_acpi_int_func(acpi_handle handle, char *pathname, int *ret,
-				int n_arg, ...)
+/*************************************************************************
+    Cost accounting
+ *************************************************************************/
+
+/* What the driver costs the machine, see debugfs cost: how often each of
+   its timers and workers wakes up the CPU, and how many firmware calls
+   are made on behalf of user space (sysfs, ioctl, procfs). The time
+   spent in the firmware itself is kept by the EC helpers and by
+   lensl_acpi_eval() below. */
+
+enum {
+	LENSL_WAKE_HKEY_POLL = 0,
+	LENSL_WAKE_LED,
+	LENSL_WAKE_WATCH,
+	LENSL_WAKE_FAN_SAMPLE,
+	LENSL_WAKE_FAN_WRITE,
+	LENSL_WAKE_ACCEL,
+	LENSL_WAKE_SOURCES,
+};
+
+static const char *lensl_wake_names[LENSL_WAKE_SOURCES] = {
+	"hkey_poll", "led_work", "watch", "fan_sample", "fan_write",
+	"accel_poll" };
+
+static struct {
+	spinlock_t lock;
+	ktime_t since;
+	unsigned long wakeups[LENSL_WAKE_SOURCES];
+	unsigned long user_calls;
+	unsigned long acpi_calls;
+	u64 acpi_ns;
+	/* heap allocations made and avoided by the typed ACPI path */
+	unsigned long allocs, allocs_avoided;
+	/* EC totals at the last reset; the EC statistics are not reset */
+	unsigned long ec_bytes_base;
+	u64 ec_ns_base, ec_wait_ns_base;
+} lensl_cost = {
+	.lock = __SPIN_LOCK_UNLOCKED(lensl_cost.lock),
+};
+
+static void lensl_cost_wakeup(int source)
 {
-	acpi_status status;
-	struct acpi_object_list params;
-	union acpi_object in_obj[LENSL_MAX_ACPI_ARGS], out_obj;
-	struct acpi_buffer result, *resultp;
-	int i;
-	va_list ap;
+	spin_lock(&lensl_cost.lock);
+	lensl_cost.wakeups[source]++;
+	spin_unlock(&lensl_cost.lock);
+}
 
-	if (!handle)
-		return -EINVAL;
-	if (n_arg < 0 || n_arg > LENSL_MAX_ACPI_ARGS)
-		return -EINVAL;
-	va_start(ap, n_arg);
-	for (i = 0; i < n_arg; i++) {
-		in_obj[i].integer.value = va_arg(ap, int);
-		in_obj[i].type = ACPI_TYPE_INTEGER;
-	}
-	va_end(ap);
-	params.count = n_arg;
-	params.pointer = in_obj;
+/* activity counters of the perf PMU, indexed by enum lensl_perf_event
+   (LENSL_PERF_FAN_RPM holds the last fan speed sampled, not a count) */
+#if LENSL_PERF
+static atomic_long_t lensl_perf_counts[__LENSL_PERF_MAX];
 
-	if (ret) {
-		result.length = sizeof(out_obj);
-		result.pointer = &out_obj;
-		resultp = &result;
-	} else
-		resultp = NULL;
+static inline void lensl_perf_count(int event, long n)
+{
+	atomic_long_add(n, &lensl_perf_counts[event]);
+}
 
-	status = acpi_evaluate_object(handle, pathname, &params, resultp);
-	if (ACPI_FAILURE(status))
-		return -EIO;
-	if (ret)
-		*ret = out_obj.integer.value;
-
-	vdbg_printk(LENSL_DEBUG, "ACPI : %s(", pathname);
-	if (dbg_level >= LENSL_DEBUG) {
-		for (i = 0; i < n_arg; i++) {
-			if (i)
-				printk(", ");
-			printk("%d", (int)in_obj[i].integer.value);
-		}
-		printk(")");
-		if (ret)
-			printk(" == %d", *ret);
-		printk("\n");
-	}
-	return 0;
+static inline void lensl_perf_sample(int event, long value)
+{
+	atomic_long_set(&lensl_perf_counts[event], value);
+}
+#else
+static inline void lensl_perf_count(int event, long n)
+{
 }
 
+static inline void lensl_perf_sample(int event, long value)
+{
+}
+#endif
+
 /*************************************************************************
-    Bluetooth, WWAN, UWB
+    EC access
  *************************************************************************/
 
+/* Every EC access and every EC-backed ACPI evaluation made by the driver
+   passes through a small scheduler. Callers belong to one of three
+   priority classes; when the EC is busy, waiters are admitted strictly by
+   class, so e.g. a running EC dump never delays the hotkey poller by more
+   than one transaction. Each class can also be limited to a number of
+   transactions per second (ec_budget); a caller over budget sleeps until
+   its class has a token again. Works of different classes therefore run
+   on different workqueues: lensl_wq carries the telemetry works, while
+   the backlight table reload and the accelerometer sampler (interactive)
+   and ec0_watch (debug) have their own, so a throttled class only delays
+   its own works. */
+
 enum {
-	/* ACPI GBDC/SBDC, GWAN/SWAN, GUWB/SUWB bits */
-	LENSL_RADIO_HWPRESENT	= 0x01, /* hardware is available */
-	LENSL_RADIO_RADIOSSW	= 0x02, /* radio is enabled */
-	LENSL_RADIO_RESUMECTRL	= 0x04, /* state at resume: off/last state */
+	LENSL_EC_INTERACTIVE = 0,	/* hotkeys, brightness, accelerometer */
+	LENSL_EC_TELEMETRY,		/* fan, radios, LED */
+	LENSL_EC_DEBUG,			/* procfs dumps and watches */
+	LENSL_EC_CLASSES,
 };
 
-typedef enum {
-	LENSL_BLUETOOTH = 0,
-	LENSL_WWAN,
-	LENSL_UWB,
-} lensl_radio_type;
-
-/* pretend_blocked indicates whether we pretend that the device is
-   hardware-blocked (used primarily to prevent the device from coming
-   online when the module is loaded) */
-struct lensl_radio {
-	lensl_radio_type type;
-	enum rfkill_type rfktype;
-	int present;
-	char *name;
-	char *rfkname;
-	struct rfkill *rfk;
-	int (*get_acpi)(int *);
-	int (*set_acpi)(int);
-	int *auto_enable;
+static struct {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	int busy;
+	int waiting[LENSL_EC_CLASSES];
+	int tokens[LENSL_EC_CLASSES];
+	unsigned long refill[LENSL_EC_CLASSES];
+	/* statistics, see debugfs ec_sched */
+	unsigned long transactions[LENSL_EC_CLASSES];
+	unsigned long throttled[LENSL_EC_CLASSES];
+	u64 queued_ns[LENSL_EC_CLASSES], max_queued_ns[LENSL_EC_CLASSES];
+} lensl_ec_sched = {
+	.lock = __SPIN_LOCK_UNLOCKED(lensl_ec_sched.lock),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(lensl_ec_sched.wait),
 };
 
-static inline int get_wlsw(int *value)
+/* token bucket holding at most one second worth of transactions; called
+   with lensl_ec_sched.lock held */
+static int lensl_ec_take_token(int class)
 {
-	return lensl_acpi_int_func(hkey_handle, "WLSW", value, 0);
+	int budget = ec_budget[class];
+	unsigned long elapsed;
+
+	if (budget <= 0)
+		return 1;
+	elapsed = min(jiffies - lensl_ec_sched.refill[class],
+			(unsigned long)HZ);
+	if (elapsed * budget >= HZ) {
+		lensl_ec_sched.tokens[class] = min_t(int, budget,
+			lensl_ec_sched.tokens[class] + elapsed * budget / HZ);
+		lensl_ec_sched.refill[class] = jiffies;
+	}
+	if (lensl_ec_sched.tokens[class] <= 0)
+		return 0;
+	lensl_ec_sched.tokens[class]--;
+	return 1;
 }
 
-static inline int get_gbdc(int *value)
+static int lensl_ec_higher_waiting(int class)
 {
-	return lensl_acpi_int_func(hkey_handle, "GBDC", value, 0);
+	int i;
+
+	for (i = 0; i < class; i++)
+		if (lensl_ec_sched.waiting[i])
+			return 1;
+	return 0;
 }
 
-static inline int get_gwan(int *value)
+static void lensl_ec_begin(int class)
 {
-	return lensl_acpi_int_func(hkey_handle, "GWAN", value, 0);
+	ktime_t start = ktime_get();
+	DEFINE_WAIT(wait);
+	u64 ns;
+
+	spin_lock(&lensl_ec_sched.lock);
+	/* a class that is over budget does not hold up lower classes */
+	while (!lensl_ec_take_token(class)) {
+		lensl_ec_sched.throttled[class]++;
+		spin_unlock(&lensl_ec_sched.lock);
+		schedule_timeout_uninterruptible(
+			max(HZ / max(ec_budget[class], 1), 1));
+		spin_lock(&lensl_ec_sched.lock);
+	}
+
+	lensl_ec_sched.waiting[class]++;
+	while (lensl_ec_sched.busy || lensl_ec_higher_waiting(class)) {
+		prepare_to_wait(&lensl_ec_sched.wait, &wait,
+				TASK_UNINTERRUPTIBLE);
+		spin_unlock(&lensl_ec_sched.lock);
+		schedule();
+		spin_lock(&lensl_ec_sched.lock);
+	}
+	finish_wait(&lensl_ec_sched.wait, &wait);
+	lensl_ec_sched.waiting[class]--;
+	lensl_ec_sched.busy = 1;
+
+	/* our kthread and workers are accounted as wakeups; anything else
+	   runs in the context of a user task */
+	if (!(current->flags & PF_KTHREAD)) {
+		spin_lock(&lensl_cost.lock);
+		lensl_cost.user_calls++;
+		spin_unlock(&lensl_cost.lock);
+	}
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lensl_ec_sched.transactions[class]++;
+	lensl_ec_sched.queued_ns[class] += ns;
+	if (ns > lensl_ec_sched.max_queued_ns[class])
+		lensl_ec_sched.max_queued_ns[class] = ns;
+	spin_unlock(&lensl_ec_sched.lock);
 }
 
-static inline int get_guwb(int *value)
+static void lensl_ec_end(int class)
 {
-	return lensl_acpi_int_func(hkey_handle, "GUWB", value, 0);
+	spin_lock(&lensl_ec_sched.lock);
+	lensl_ec_sched.busy = 0;
+	spin_unlock(&lensl_ec_sched.lock);
+	wake_up_all(&lensl_ec_sched.wait);
 }
 
-static inline int set_sbdc(int value)
+/* Every firmware access (EC register read or write, ACPI method call) is
+   made through lensl_fw_ec_read(), lensl_fw_ec_write() or
+   lensl_fw_acpi_eval(). With trace_size set, each access is recorded
+   with its result and duration into a ring that userspace drains from
+   <debugfs>/lenovo-sl-laptop/trace as struct lensl_trace_rec. Such a
+   capture, loaded with replay=<file>, replaces the hardware: accesses
+   are then answered from the capture and the firmware is never touched,
+   so a trace from the field can be run again on any machine. Likewise,
+   simulate=1 answers them from a minimal model of the SL firmware, to
+   load and benchmark the driver without the hardware. */
+
+#if LENSL_CONFIG_TRACE
+
+/* concurrent callers (poll thread, workers, sysfs) interleave, so a
+   replayed access may match any unused record this close to the oldest
+   unused one */
+#define LENSL_REPLAY_WINDOW 16
+
+static struct {
+	spinlock_t lock;
+	/* recording */
+	struct lensl_trace_rec *ring;
+	unsigned int size, head, tail;
+	unsigned long recorded, lost;
+	/* replay */
+	const struct firmware *fw;
+	const struct lensl_trace_rec *recs;
+	unsigned long *used;
+	unsigned int count, cursor;
+	unsigned long replayed, mismatched, exhausted;
+} lensl_trace = {
+	.lock = __SPIN_LOCK_UNLOCKED(lensl_trace.lock),
+};
+
+/* stand-ins for the ACPI handles while replaying or simulating; never
+   dereferenced */
+static char lensl_replay_handles[2];
+
+/* whether a capture or the simulator stands in for the firmware; fixed
+   at load time */
+#define lensl_fw_virtual() (simulate || (replay && *replay))
+#define lensl_tracing() (lensl_trace.ring || lensl_fw_virtual())
+
+static int lensl_acpi_target(acpi_handle handle)
 {
-	return lensl_acpi_int_func(hkey_handle, "SBDC", NULL, 1, value);
+	if (handle == lensl->hkey_handle)
+		return LENSL_TRACE_HKEY;
+	if (handle == lensl->ec0_handle)
+		return LENSL_TRACE_EC0;
+	if (handle && handle == lensl->bat0_handle)
+		return LENSL_TRACE_BAT;
+	return LENSL_TRACE_LCDD;
 }
 
-static inline int set_swan(int value)
+static void lensl_trace_add(struct lensl_trace_rec *rec, ktime_t start)
 {
-	return lensl_acpi_int_func(hkey_handle, "SWAN", NULL, 1, value);
+	rec->timestamp = ktime_to_ns(start);
+	rec->duration = ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_lock(&lensl_trace.lock);
+	if (lensl_trace.head - lensl_trace.tail == lensl_trace.size) {
+		lensl_trace.tail++;
+		lensl_trace.lost++;
+	}
+	lensl_trace.ring[lensl_trace.head++ % lensl_trace.size] = *rec;
+	lensl_trace.recorded++;
+	spin_unlock(&lensl_trace.lock);
 }
 
-static inline int set_suwb(int value)
+/* answer an access from the capture: find an unused record with the same
+   type, target, method and arguments (and value, for EC writes), copy
+   its value into rec and return its result */
+static int lensl_replay_access(struct lensl_trace_rec *rec)
 {
-	return lensl_acpi_int_func(hkey_handle, "SUWB", NULL, 1, value);
+	const struct lensl_trace_rec *r;
+	unsigned int i, end;
+	int res = -EIO;
+
+	spin_lock(&lensl_trace.lock);
+	while (lensl_trace.cursor < lensl_trace.count &&
+	       test_bit(lensl_trace.cursor, lensl_trace.used))
+		lensl_trace.cursor++;
+	end = min(lensl_trace.cursor + LENSL_REPLAY_WINDOW, lensl_trace.count);
+	for (i = lensl_trace.cursor; i < end; i++) {
+		r = &lensl_trace.recs[i];
+		if (test_bit(i, lensl_trace.used) || r->type != rec->type ||
+		    r->target != rec->target || r->argc != rec->argc ||
+		    memcmp(r->method, rec->method, sizeof(r->method)) ||
+		    memcmp(r->args, rec->args, sizeof(r->args)))
+			continue;
+		if (rec->type == LENSL_TRACE_EC_WRITE && r->value != rec->value)
+			continue;
+		__set_bit(i, lensl_trace.used);
+		lensl_trace.replayed++;
+		rec->value = r->value;
+		res = r->result;
+		goto out;
+	}
+	if (lensl_trace.cursor == lensl_trace.count)
+		lensl_trace.exhausted++;
+	else
+		lensl_trace.mismatched++;
+out:
+	spin_unlock(&lensl_trace.lock);
+	if (res == -EIO)
+		vdbg_printk(LENSL_DEBUG, "replay: no record for %d/%d %.4s\n",
+			rec->type, rec->target, rec->method);
+	return res;
 }
 
-static int lensl_radio_get(struct lensl_radio *radio, int *hw_blocked,
-				int *value)
-{
-	int wlsw;
+/* Simulated firmware: the EC is a plain register file and the ACPI
+   methods used by the driver act on a few variables. Hotkeys can be
+   produced by writing the EC ring (0x0A-0x11) and its offset (0x12),
+   which is mirrored into 0x14 like the firmware does. */
+static struct {
+	spinlock_t lock;
+	u8 ec[256];
+	int wlsw, radio[3], fan_manual, pwm, led, level;
+} lensl_sim = {
+	.lock = __SPIN_LOCK_UNLOCKED(lensl_sim.lock),
+};
 
-	*hw_blocked = 0;
-	if (!radio)
-		return -EINVAL;
-	if (!radio->present)
-		return -ENODEV;
-	if (!get_wlsw(&wlsw) && !wlsw)
-		*hw_blocked = 1;
-	if (radio->get_acpi(value))
-		return -EIO;
-	return 0;
+static void lensl_sim_reset(void)
+{
+	spin_lock(&lensl_sim.lock);
+	memset(lensl_sim.ec, 0, sizeof(lensl_sim.ec));
+	lensl_sim.wlsw = 1;
+	/* GBDC, GWAN and GUWB: present and on */
+	lensl_sim.radio[0] = lensl_sim.radio[1] = lensl_sim.radio[2] = 0x03;
+	lensl_sim.fan_manual = 0;
+	lensl_sim.pwm = 126;
+	lensl_sim.led = 0;
+	lensl_sim.level = 7;
+	spin_unlock(&lensl_sim.lock);
 }
 
-static int lensl_radio_set_on(struct lensl_radio *radio, int *hw_blocked,
-				bool on)
+static int lensl_sim_acpi(struct lensl_trace_rec *rec)
 {
-	int value, ret;
-	if ((ret = lensl_radio_get(radio, hw_blocked, &value)) < 0)
-		return ret;
-	/* WLSW overrides radio in firmware/hardware, but there is
-	   no reason to risk weird behaviour. */
-	if (*hw_blocked)
-		return ret;
-	if (on)
-		value |= LENSL_RADIO_RADIOSSW;
+	static const char *radio_get[] = { "GBDC", "GWAN", "GUWB" };
+	static const char *radio_set[] = { "SBDC", "SWAN", "SUWB" };
+	char *m = rec->method;
+	int i;
+
+#define LENSL_SIM_IS(name) (!memcmp(m, name, sizeof(rec->method)))
+	for (i = 0; i < ARRAY_SIZE(radio_get); i++) {
+		if (LENSL_SIM_IS(radio_get[i])) {
+			rec->value = lensl_sim.radio[i];
+			return 0;
+		}
+		if (LENSL_SIM_IS(radio_set[i])) {
+			lensl_sim.radio[i] = rec->args[0];
+			return 0;
+		}
+	}
+	if (LENSL_SIM_IS("WLSW"))
+		rec->value = lensl_sim.wlsw;
+	else if (LENSL_SIM_IS("DECF"))
+		rec->value = lensl_sim.fan_manual;
+	else if (LENSL_SIM_IS("SFNV")) {
+		lensl_sim.fan_manual = rec->args[0];
+		lensl_sim.pwm = rec->args[1];
+	} else if (LENSL_SIM_IS("TACH"))
+		/* DEFAULT_PWM1 runs at about 2700 rpm */
+		rec->value = lensl_sim.fan_manual ?
+			lensl_sim.pwm * 2700 / 126 : 2700;
+	else if (LENSL_SIM_IS("TVLS"))
+		lensl_sim.led = rec->args[0];
+	else if (LENSL_SIM_IS("_BCM"))
+		lensl_sim.level = rec->args[0];
+	else if (LENSL_SIM_IS("_BQC"))
+		rec->value = lensl_sim.level;
 	else
-		value &= ~LENSL_RADIO_RADIOSSW;
-	if (radio->set_acpi(value))
 		return -EIO;
+#undef LENSL_SIM_IS
 	return 0;
 }
 
-/* Bluetooth/WWAN/UWB rfkill interface */
+static int lensl_sim_access(struct lensl_trace_rec *rec)
+{
+	int res = 0;
+
+	if (sim_latency > 0)
+		udelay(sim_latency);
+	spin_lock(&lensl_sim.lock);
+	switch (rec->type) {
+	case LENSL_TRACE_EC_READ:
+		rec->value = lensl_sim.ec[rec->target];
+		break;
+	case LENSL_TRACE_EC_WRITE:
+		lensl_sim.ec[rec->target] = rec->value;
+		if (rec->target == 0x12)
+			lensl_sim.ec[0x14] = rec->value;
+		break;
+	default:
+		res = lensl_sim_acpi(rec);
+	}
+	spin_unlock(&lensl_sim.lock);
+	return res;
+}
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30)
+static int lensl_fw_virtual_access(struct lensl_trace_rec *rec)
+{
+	if (simulate)
+		return lensl_sim_access(rec);
+	return lensl_replay_access(rec);
+}
 
-static int lensl_radio_rfkill_get_state(void *data, enum rfkill_state *state)
+/* replayed and simulated accesses are recorded too, so the simulator
+   can produce captures */
+static int lensl_fw_ec_read(u8 reg, u8 *value)
 {
-	int ret, value, hw_blocked = 0;
-	ret = lensl_radio_get((struct lensl_radio *)data,
-		&hw_blocked, &value);
+	struct lensl_trace_rec rec;
+	ktime_t start;
+	int res;
 
-	if (hw_blocked) {
-		*state = RFKILL_STATE_HARD_BLOCKED;
-		return 0;
+	if (!lensl_tracing())
+		return ec_read(reg, value);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LENSL_TRACE_EC_READ;
+	rec.target = reg;
+	start = ktime_get();
+	if (lensl_fw_virtual()) {
+		res = lensl_fw_virtual_access(&rec);
+		*value = rec.value;
+	} else {
+		res = ec_read(reg, value);
+		rec.value = *value;
 	}
+	rec.result = res;
+	if (lensl_trace.ring)
+		lensl_trace_add(&rec, start);
+	return res;
+}
 
-	if (ret)
-		return ret;
+static int lensl_fw_ec_write(u8 reg, u8 value)
+{
+	struct lensl_trace_rec rec;
+	ktime_t start;
+	int res;
 
-	if (value & LENSL_RADIO_RADIOSSW)
-		*state = RFKILL_STATE_UNBLOCKED;
+	if (!lensl_tracing())
+		return ec_write(reg, value);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LENSL_TRACE_EC_WRITE;
+	rec.target = reg;
+	rec.value = value;
+	start = ktime_get();
+	if (lensl_fw_virtual())
+		res = lensl_fw_virtual_access(&rec);
 	else
-		*state = RFKILL_STATE_SOFT_BLOCKED;
-	return 0;
+		res = ec_write(reg, value);
+	rec.result = res;
+	if (lensl_trace.ring)
+		lensl_trace_add(&rec, start);
+	return res;
 }
 
-static int lensl_radio_rfkill_toggle_radio(void *data, enum rfkill_state state)
+/* integer arguments only; only integer results are captured, replayed
+   or simulated */
+static acpi_status lensl_fw_acpi_eval(acpi_handle handle, char *pathname,
+		struct acpi_object_list *params, struct acpi_buffer *result)
 {
-	int ret, value, hw_blocked = 0;
-	ret = lensl_radio_get((struct lensl_radio *)data,
-		&hw_blocked, &value);
+	union acpi_object *out = result ? result->pointer : NULL;
+	struct lensl_trace_rec rec;
+	acpi_status status;
+	ktime_t start;
+	int i;
 
-	if (state == RFKILL_STATE_UNBLOCKED) {
-		if (hw_blocked)
-			return -EPERM;
-		if (ret)
-			return ret;
-		value = 1;
+	if (!lensl_tracing())
+		return acpi_evaluate_object(handle, pathname, params, result);
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LENSL_TRACE_ACPI;
+	rec.target = lensl_acpi_target(handle);
+	rec.argc = params ? params->count : 0;
+	rec.flags = out ? LENSL_TRACE_RET : 0;
+	strncpy(rec.method, pathname, sizeof(rec.method));
+	for (i = 0; i < rec.argc && i < ARRAY_SIZE(rec.args); i++)
+		rec.args[i] = params->pointer[i].integer.value;
+	start = ktime_get();
+	if (lensl_fw_virtual()) {
+		rec.result = lensl_fw_virtual_access(&rec);
+		status = rec.result ? AE_ERROR : AE_OK;
+		if (!rec.result && out) {
+			out->type = ACPI_TYPE_INTEGER;
+			out->integer.value = rec.value;
+		}
 	} else {
-		if (ret && !hw_blocked)
-			return ret;
-		value = 0;
+		status = acpi_evaluate_object(handle, pathname, params,
+					      result);
+		if (ACPI_FAILURE(status))
+			rec.result = -EIO;
+		else if (out && out->type == ACPI_TYPE_INTEGER)
+			rec.value = out->integer.value;
 	}
+	if (lensl_trace.ring)
+		lensl_trace_add(&rec, start);
+	return status;
+}
 
-	ret = lensl_radio_set_on((struct lensl_radio *)data,
-		&hw_blocked, value);
-
-	if (hw_blocked)
-		return 0;
-	return ret;
+static void lensl_trace_exit(void)
+{
+	lensl_trace.recs = NULL;
+	if (lensl_trace.fw)
+		release_firmware(lensl_trace.fw);
+	lensl_trace.fw = NULL;
+	kfree(lensl_trace.used);
+	lensl_trace.used = NULL;
+	lensl_trace.count = 0;
+	vfree(lensl_trace.ring);
+	lensl_trace.ring = NULL;
+	lensl_trace.size = 0;
 }
 
-static int lensl_radio_new_rfkill(struct lensl_radio *radio,
-			struct rfkill **rfk, bool sw_blocked,
-			bool hw_blocked)
+/* needs lensl_pdev for request_firmware(); nothing may access the
+   firmware before this when replaying or simulating */
+static int lensl_trace_init(void)
 {
+	const struct firmware *fw;
 	int res;
 
-	*rfk = rfkill_allocate(&lensl_pdev->dev, radio->rfktype);
-	if (!*rfk) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to allocate memory for rfkill class\n");
-		return -ENOMEM;
+	if (simulate) {
+		lensl_sim_reset();
+		vdbg_printk(LENSL_INFO, "Using the simulated firmware\n");
 	}
-
-	(*rfk)->name = radio->rfkname;
-	(*rfk)->get_state = lensl_radio_rfkill_get_state;
-	(*rfk)->toggle_radio = lensl_radio_rfkill_toggle_radio;
-	(*rfk)->data = radio;
-
-	if (hw_blocked)
-		(*rfk)->state = RFKILL_STATE_HARD_BLOCKED;
-	else if (sw_blocked)
-		(*rfk)->state = RFKILL_STATE_SOFT_BLOCKED;
-	else
-		(*rfk)->state = RFKILL_STATE_UNBLOCKED;
-
-	res = rfkill_register(*rfk);
-	if (res < 0) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to register %s rfkill switch: %d\n",
-			radio->rfkname, res);
-		rfkill_free(*rfk);
-		*rfk = NULL;
-		return res;
+	if (trace_size > 0) {
+		lensl_trace.ring = vmalloc(trace_size *
+				sizeof(struct lensl_trace_rec));
+		if (lensl_trace.ring)
+			lensl_trace.size = trace_size;
+		else
+			vdbg_printk(LENSL_WARNING,
+				"Failed to allocate the trace ring\n");
 	}
+	if (simulate || !replay || !*replay)
+		return 0;
 
+	res = request_firmware(&fw, replay, &lensl_pdev->dev);
+	if (res) {
+		vdbg_printk(LENSL_ERR, "Failed to load capture %s\n", replay);
+		goto err;
+	}
+	lensl_trace.fw = fw;
+	if (!fw->size || fw->size % sizeof(struct lensl_trace_rec)) {
+		vdbg_printk(LENSL_ERR, "%s is not a capture\n", replay);
+		res = -EINVAL;
+		goto err;
+	}
+	lensl_trace.count = fw->size / sizeof(struct lensl_trace_rec);
+	lensl_trace.used = kcalloc(BITS_TO_LONGS(lensl_trace.count),
+				sizeof(unsigned long), GFP_KERNEL);
+	if (!lensl_trace.used) {
+		res = -ENOMEM;
+		goto err;
+	}
+	lensl_trace.recs = (const struct lensl_trace_rec *)fw->data;
+	vdbg_printk(LENSL_INFO, "Replaying %u firmware accesses from %s\n",
+		lensl_trace.count, replay);
 	return 0;
+
+err:
+	lensl_trace_exit();
+	return res;
 }
 
-#else
+#else /* LENSL_CONFIG_TRACE */
 
-static void lensl_radio_rfkill_query(struct rfkill *rfk, void *data)
-{
-	int ret, value = 0;
-	ret = get_wlsw(&value);
-	if (ret)
-		return;
-	rfkill_set_hw_state(rfk, !value);
-}
+#define lensl_fw_virtual() 0
+#define lensl_fw_ec_read ec_read
+#define lensl_fw_ec_write ec_write
+#define lensl_fw_acpi_eval acpi_evaluate_object
 
-static int lensl_radio_rfkill_set_block(void *data, bool blocked)
+static void lensl_trace_exit(void)
 {
-	int ret, hw_blocked = 0;
-	ret = lensl_radio_set_on((struct lensl_radio *)data,
-		&hw_blocked, !blocked);
-	/* rfkill spec: just return 0 on hard block */
-	return ret;
 }
 
-static struct rfkill_ops rfkops = {
-	NULL,
-	lensl_radio_rfkill_query,
-	lensl_radio_rfkill_set_block,
-};
-
-static int lensl_radio_new_rfkill(struct lensl_radio *radio,
-			struct rfkill **rfk, bool sw_blocked,
-			bool hw_blocked)
+static int lensl_trace_init(void)
 {
-	int res;		
-		
-	*rfk = rfkill_alloc(radio->rfkname, &lensl_pdev->dev, radio->rfktype,
-			&rfkops, radio);
-	if (!*rfk) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to allocate memory for rfkill class\n");
-		return -ENOMEM;
-	}
+	return 0;
+}
 
-	rfkill_set_hw_state(*rfk, hw_blocked);
-	rfkill_set_sw_state(*rfk, sw_blocked);
+#endif /* LENSL_CONFIG_TRACE */
 
-	res = rfkill_register(*rfk);
-	if (res < 0) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to register %s rfkill switch: %d\n",
-			radio->rfkname, res);
-		rfkill_destroy(*rfk);
-		*rfk = NULL;
-		return res;
-	}
+/* Direct EC register accesses go through the helpers below. Accesses to
+   several registers are done in EC burst mode, which keeps the EC
+   dedicated to the host for the duration instead of making every byte
+   a full handshake with the EC firmware; if the EC refuses to enter
+   burst mode, we fall back to plain byte-by-byte accesses. */
 
-	return 0;
-}
+/* from the ACPI spec; ec.c keeps its own copies private */
+#define LENSL_EC_BURST_ENABLE	0x82
+#define LENSL_EC_BURST_DISABLE	0x83
+#define LENSL_EC_BURST_ACK	0x90
 
-#endif /* LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30) */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,29)
+#define lensl_ec_transaction(cmd, wdata, wlen, rdata, rlen) \
+	ec_transaction(cmd, wdata, wlen, rdata, rlen, 0)
+#else
+#define lensl_ec_transaction(cmd, wdata, wlen, rdata, rlen) \
+	ec_transaction(cmd, wdata, wlen, rdata, rlen)
+#endif
 
-/* Bluetooth/WWAN/UWB init and exit */
+enum { LENSL_EC_MODE_BYTE = 0, LENSL_EC_MODE_BURST, LENSL_EC_MODES };
 
-static struct lensl_radio lensl_radios[3] = {
-	{
-		LENSL_BLUETOOTH,
-		RFKILL_TYPE_BLUETOOTH,
-		0,
-		"bluetooth",
-		"lensl_bluetooth_sw",
-		NULL,
-		get_gbdc,
-		set_sbdc,
-		&bluetooth_auto_enable,
-	},
-	{
-		LENSL_WWAN,
-		RFKILL_TYPE_WWAN,
-		0,
-		"WWAN",
-		"lensl_wwan_sw",
-		NULL,
-		get_gwan,
-		set_swan,
-		&wwan_auto_enable,
-	},
-	{
-		LENSL_UWB,
-		RFKILL_TYPE_UWB,
-		0,
-		"UWB",
-		"lensl_uwb_sw",
-		NULL,
-		get_guwb,
-		set_suwb,
-		&uwb_auto_enable,
-	},
+/* cost of EC accesses by transport mode, see debugfs ec_transport */
+static struct {
+	spinlock_t lock;
+	unsigned long calls[LENSL_EC_MODES], bytes[LENSL_EC_MODES];
+	u64 ns[LENSL_EC_MODES];
+	unsigned long refused;
+} lensl_ec_stats = {
+	.lock = __SPIN_LOCK_UNLOCKED(lensl_ec_stats.lock),
 };
 
-static void radio_exit(lensl_radio_type type)
+static void lensl_ec_account(int mode, int bytes, ktime_t start)
 {
-	if (lensl_radios[type].rfk)
-		rfkill_unregister(lensl_radios[type].rfk);
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	unsigned long flags;
+
+	spin_lock_irqsave(&lensl_ec_stats.lock, flags);
+	lensl_ec_stats.calls[mode]++;
+	lensl_ec_stats.bytes[mode] += bytes;
+	lensl_ec_stats.ns[mode] += ns;
+	spin_unlock_irqrestore(&lensl_ec_stats.lock, flags);
 }
 
-static int radio_init(lensl_radio_type type)
+static int lensl_ec_burst_enable(void)
 {
-	int value, res, hw_blocked = 0, sw_blocked;
+	u8 ack = 0;
+	unsigned long flags;
 
-	if (!hkey_handle)
-		return -ENODEV;
-	lensl_radios[type].present = 1; /* need for lensl_radio_get */
-	res = lensl_radio_get(&lensl_radios[type], &hw_blocked, &value);
-	lensl_radios[type].present = 0;
-	if (res && !hw_blocked)
-		return -EIO;
-	if (!(value & LENSL_RADIO_HWPRESENT))
+	/* the burst handshake is neither captured nor simulated */
+	if (lensl_fw_virtual())
 		return -ENODEV;
-	lensl_radios[type].present = 1;
-
-	if (*lensl_radios[type].auto_enable) {
-		sw_blocked = 0;
-		value |= LENSL_RADIO_RADIOSSW;
-		lensl_radios[type].set_acpi(value);
-	} else {
-		sw_blocked = 1;
-		value &= ~LENSL_RADIO_RADIOSSW;
-		lensl_radios[type].set_acpi(value);
-	}
-
-	res = lensl_radio_new_rfkill(&lensl_radios[type], &lensl_radios[type].rfk,
-					sw_blocked, hw_blocked);
-
-	if (res) {
-		radio_exit(type);
-		return res;
-	}
-	vdbg_printk(LENSL_DEBUG, "Initialized %s subdriver\n",
-		lensl_radios[type].name);
-
-	return 0;
+	if (!lensl_ec_transaction(LENSL_EC_BURST_ENABLE, NULL, 0, &ack, 1) &&
+			ack == LENSL_EC_BURST_ACK)
+		return 0;
+	spin_lock_irqsave(&lensl_ec_stats.lock, flags);
+	lensl_ec_stats.refused++;
+	spin_unlock_irqrestore(&lensl_ec_stats.lock, flags);
+	return -EBUSY;
 }
 
-/*************************************************************************
-    backlight control - based on video.c
- *************************************************************************/
-
-/* NB: the reason why this needs to be implemented here is that the SL series
-   uses the ACPI interface for controlling the backlight in a non-standard
-   manner. See http://bugzilla.kernel.org/show_bug.cgi?id=12249  */
-
-static acpi_handle lcdd_handle;
-static struct backlight_device *backlight;
-static struct lensl_vector {
-	int count;
-	int *values;
-} backlight_levels;
-
-static int get_bcl(struct lensl_vector *levels)
+static void lensl_ec_burst_disable(void)
 {
-	int i, status;
-	struct acpi_buffer buffer = { ACPI_ALLOCATE_BUFFER, NULL };
-	union acpi_object *o, *obj;
-
-	if (!levels)
-		return -EINVAL;
-	if (levels->count) {
-		levels->count = 0;
-		kfree(levels->values);
-	}
-
-	/* _BCL returns an array sorted from high to low; the first two values
-	   are *not* special (non-standard behavior) */
-	status = acpi_evaluate_object(lcdd_handle, "_BCL", NULL, &buffer);
-	if (!ACPI_SUCCESS(status))
-		return status;
-	obj = (union acpi_object *)buffer.pointer;
-	if (!obj || (obj->type != ACPI_TYPE_PACKAGE)) {
-		vdbg_printk(LENSL_ERR, "Invalid _BCL data\n");
-		status = -EFAULT;
-		goto out;
-	}
-
-	levels->count = obj->package.count;
-	if (!levels->count)
-		goto out;
-	levels->values = kmalloc(levels->count * sizeof(int), GFP_KERNEL);
-	if (!levels->values) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to allocate memory for brightness levels\n");
-		status = -ENOMEM;
-		goto out;
-	}
+	lensl_ec_transaction(LENSL_EC_BURST_DISABLE, NULL, 0, NULL, 0);
+}
 
-	for (i = 0; i < obj->package.count; i++) {
-		o = (union acpi_object *)&obj->package.elements[i];
-		if (o->type != ACPI_TYPE_INTEGER) {
-			vdbg_printk(LENSL_ERR, "Invalid brightness data\n");
-			goto err;
-		}
-		levels->values[i] = (int) o->integer.value;
-	}
-	goto out;
+static int lensl_ec_read(int class, u8 reg, u8 *value)
+{
+	ktime_t start;
+	int res;
 
-err:
-	levels->count = 0;
-	kfree(levels->values);
+	lensl_ec_begin(class);
+	start = ktime_get();
+	res = lensl_fw_ec_read(reg, value);
+	lensl_ec_account(LENSL_EC_MODE_BYTE, 1, start);
+	lensl_ec_end(class);
+	lensl_perf_count(LENSL_PERF_EC_READS, 1);
+	return res;
+}
 
-out:
-	kfree(buffer.pointer);
+static int lensl_ec_write(int class, u8 reg, u8 value)
+{
+	ktime_t start;
+	int res;
 
-	return status;
+	lensl_ec_begin(class);
+	start = ktime_get();
+	res = lensl_fw_ec_write(reg, value);
+	lensl_ec_account(LENSL_EC_MODE_BYTE, 1, start);
+	lensl_ec_end(class);
+	lensl_perf_count(LENSL_PERF_EC_WRITES, 1);
+	return res;
 }
 
-static inline int set_bcm(int level)
+/* read len consecutive registers starting at reg (reg + len <= 0xFF);
+   returns 0 or the error of the first failed read */
+static int lensl_ec_read_block(int class, u8 reg, u8 *buf, int len)
 {
-	/* standard behavior */
-	return lensl_acpi_int_func(lcdd_handle, "_BCM", NULL, 1, level);
+	ktime_t start;
+	int i, res = 0, mode = LENSL_EC_MODE_BYTE;
+
+	lensl_ec_begin(class);
+	start = ktime_get();
+	if (len > 1 && ec_burst && !lensl_ec_burst_enable())
+		mode = LENSL_EC_MODE_BURST;
+	for (i = 0; i < len && !res; i++)
+		res = lensl_fw_ec_read(reg + i, &buf[i]);
+	if (mode == LENSL_EC_MODE_BURST)
+		lensl_ec_burst_disable();
+	lensl_ec_account(mode, i, start);
+	lensl_ec_end(class);
+	lensl_perf_count(LENSL_PERF_EC_READS, i);
+	return res;
 }
 
-static inline int get_bqc(int *level)
+static int lensl_ec_write_block(int class, u8 reg, const u8 *buf, int len)
 {
-	/* returns an index from the bottom into the _BCL package
-	   (non-standard behavior) */
-	return lensl_acpi_int_func(lcdd_handle, "_BQC", level, 0);
+	ktime_t start;
+	int i, res = 0, mode = LENSL_EC_MODE_BYTE;
+
+	lensl_ec_begin(class);
+	start = ktime_get();
+	if (len > 1 && ec_burst && !lensl_ec_burst_enable())
+		mode = LENSL_EC_MODE_BURST;
+	for (i = 0; i < len && !res; i++)
+		res = lensl_fw_ec_write(reg + i, buf[i]);
+	if (mode == LENSL_EC_MODE_BURST)
+		lensl_ec_burst_disable();
+	lensl_ec_account(mode, i, start);
+	lensl_ec_end(class);
+	lensl_perf_count(LENSL_PERF_EC_WRITES, i);
+	return res;
 }
 
-/* backlight device sysfs support */
-static int lensl_bd_get_brightness(struct backlight_device *bd)
+/* evaluate an ACPI method as one transaction of the given class */
+static acpi_status lensl_acpi_eval(int class, acpi_handle handle,
+		char *pathname, struct acpi_object_list *params,
+		struct acpi_buffer *result)
 {
-	int level = 0;
-
-	if (get_bqc(&level))
-		return 0;
-
-	return level;
+	acpi_status status;
+	ktime_t start;
+	s64 ns;
+
+	lensl_ec_begin(class);
+	start = ktime_get();
+	status = lensl_fw_acpi_eval(handle, pathname, params, result);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lensl_ec_end(class);
+
+	spin_lock(&lensl_cost.lock);
+	lensl_cost.acpi_calls++;
+	lensl_cost.acpi_ns += ns;
+	spin_unlock(&lensl_cost.lock);
+	if (handle == lensl->hkey_handle)
+		lensl_perf_count(LENSL_PERF_ACPI_HKEY, 1);
+	else if (handle == lensl->lcdd_handle)
+		lensl_perf_count(LENSL_PERF_ACPI_LCDD, 1);
+	else
+		lensl_perf_count(LENSL_PERF_ACPI_EC0, 1);
+	return status;
 }
 
-static int lensl_bd_set_brightness_int(int request_level)
-{
-	int n;
-	n = backlight_levels.count - request_level - 1;
-	if (n >= 0 && n < backlight_levels.count)
-		return set_bcm(backlight_levels.values[n]);
+/* Typed ACPI evaluation. The caller states the result type it expects
+   and provides the storage for it: an integer, or for a buffer or a
+   package of integers an array of res->size bytes or ints, of which
+   res->count are filled in. ACPICA writes the returned object into a
+   preallocated scratch area, so no evaluation allocates memory unless
+   the object does not fit; it is then evaluated a second time into a
+   buffer allocated by ACPICA, which is only safe for methods without
+   side effects (all non-integer methods used here are). */
 
-	return -EINVAL;
-}
+enum {
+	LENSL_ACPI_NONE = 0,
+	LENSL_ACPI_INTEGER,
+	LENSL_ACPI_BUFFER,
+	LENSL_ACPI_PACKAGE,		/* of integers */
+};
 
-static int lensl_bd_set_brightness(struct backlight_device *bd)
-{
-	if (!bd)
-		return -EINVAL;
+struct lensl_acpi_result {
+	int type;
+	int integer;
+	void *data;
+	int size, count;
+};
 
-	return lensl_bd_set_brightness_int(bd->props.brightness);
-}
+/* room for a package of LENSL_BCL_MAX integers, e.g. _BCL */
+#define LENSL_ACPI_SCRATCH_OBJS 136
 
-static struct backlight_ops lensl_backlight_ops = {
-	.get_brightness = lensl_bd_get_brightness,
-	.update_status  = lensl_bd_set_brightness,
+static struct {
+	struct mutex lock;
+	union acpi_object objs[LENSL_ACPI_SCRATCH_OBJS];
+} lensl_acpi_scratch = {
+	.lock = __MUTEX_INITIALIZER(lensl_acpi_scratch.lock),
 };
 
-static void backlight_exit(void)
+static void lensl_acpi_count_alloc(int avoided)
 {
-	backlight_device_unregister(backlight);
-	backlight = NULL;
-	if (backlight_levels.count) {
-		kfree(backlight_levels.values);
-		backlight_levels.count = 0;
-	}
+	spin_lock(&lensl_cost.lock);
+	if (avoided)
+		lensl_cost.allocs_avoided++;
+	else
+		lensl_cost.allocs++;
+	spin_unlock(&lensl_cost.lock);
 }
 
-static int backlight_init(void)
+static int lensl_acpi_unpack(const union acpi_object *obj,
+		struct lensl_acpi_result *res)
 {
-	int status = 0;
-
-	lcdd_handle = NULL;
-	backlight = NULL;
-	backlight_levels.count = 0;
-	backlight_levels.values = NULL;
+	int i;
 
-	status = acpi_get_handle(NULL, LENSL_LCDD, &lcdd_handle);
-	if (ACPI_FAILURE(status)) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to get ACPI handle for %s\n", LENSL_LCDD);
-		return -EIO;
+	switch (res->type) {
+	case LENSL_ACPI_INTEGER:
+		if (obj->type != ACPI_TYPE_INTEGER)
+			return -EFAULT;
+		res->integer = obj->integer.value;
+		res->count = 1;
+		return 0;
+	case LENSL_ACPI_BUFFER:
+		if (obj->type != ACPI_TYPE_BUFFER)
+			return -EFAULT;
+		res->count = obj->buffer.length;
+		if (res->count > res->size)
+			return -EOVERFLOW;
+		memcpy(res->data, obj->buffer.pointer, res->count);
+		return 0;
+	case LENSL_ACPI_PACKAGE:
+		if (obj->type != ACPI_TYPE_PACKAGE)
+			return -EFAULT;
+		res->count = obj->package.count;
+		if (res->count > res->size)
+			return -EOVERFLOW;
+		for (i = 0; i < res->count; i++) {
+			if (obj->package.elements[i].type != ACPI_TYPE_INTEGER)
+				return -EFAULT;
+			((int *)res->data)[i] =
+				obj->package.elements[i].integer.value;
+		}
+		return 0;
 	}
+	return -EINVAL;
+}
 
-	status = get_bcl(&backlight_levels);
-	if (status || !backlight_levels.count)
-		goto err;
+static int lensl_acpi_typed_func(acpi_handle handle, char *pathname,
+		struct lensl_acpi_result *res, int n_arg, const int *args)
+{
+	acpi_status status;
+	struct acpi_object_list params;
+	union acpi_object in_obj[LENSL_MAX_ACPI_ARGS], out_obj;
+	struct acpi_buffer result, *resultp = NULL;
+	int i, class, locked = 0, err = 0;
 
-	backlight = backlight_device_register(LENSL_BACKLIGHT_NAME,
-			NULL, NULL, &lensl_backlight_ops);
-	backlight->props.max_brightness = backlight_levels.count - 1;
-	backlight->props.brightness = lensl_bd_get_brightness(backlight);
-	vdbg_printk(LENSL_INFO, "Started backlight brightness control\n");
-	goto out;
-err:
-	if (backlight_levels.count) {
-		kfree(backlight_levels.values);
-		backlight_levels.count = 0;
+	if (!handle)
+		return -EINVAL;
+	if (n_arg < 0 || n_arg > LENSL_MAX_ACPI_ARGS)
+		return -EINVAL;
+	for (i = 0; i < n_arg; i++) {
+		in_obj[i].integer.value = args[i];
+		in_obj[i].type = ACPI_TYPE_INTEGER;
 	}
-	vdbg_printk(LENSL_ERR,
-		"Failed to start backlight brightness control\n");
-out:
-	return status;
+	params.count = n_arg;
+	params.pointer = in_obj;
+
+	if (res && res->type == LENSL_ACPI_INTEGER) {
+		result.length = sizeof(out_obj);
+		result.pointer = &out_obj;
+		resultp = &result;
+	} else if (res && res->type != LENSL_ACPI_NONE) {
+		mutex_lock(&lensl_acpi_scratch.lock);
+		locked = 1;
+		result.length = sizeof(lensl_acpi_scratch.objs);
+		result.pointer = lensl_acpi_scratch.objs;
+		resultp = &result;
+	}
+
+	/* everything but the backlight (LCDD) is telemetry-class */
+	class = handle == lensl->lcdd_handle ?
+		LENSL_EC_INTERACTIVE : LENSL_EC_TELEMETRY;
+	status = lensl_acpi_eval(class, handle, pathname, &params, resultp);
+	if (locked && status == AE_BUFFER_OVERFLOW) {
+		/* too large for the scratch area */
+		result.length = ACPI_ALLOCATE_BUFFER;
+		result.pointer = NULL;
+		status = lensl_acpi_eval(class, handle, pathname, &params,
+					resultp);
+		lensl_acpi_count_alloc(0);
+	} else if (locked && ACPI_SUCCESS(status))
+		lensl_acpi_count_alloc(1);
+	if (ACPI_FAILURE(status))
+		err = -EIO;
+	else if (resultp)
+		err = result.pointer ?
+			lensl_acpi_unpack(result.pointer, res) : -EFAULT;
+	if (locked) {
+		if (result.pointer != lensl_acpi_scratch.objs)
+			kfree(result.pointer);
+		mutex_unlock(&lensl_acpi_scratch.lock);
+	}
+	if (err)
+		return err;
+
+	if (lensl_debug_on()) {
+		/* format the whole call into one line instead of emitting
+		   a printk per argument */
+		char argbuf[LENSL_MAX_ACPI_ARGS * 13 + 1];
+		int len = 0;
+
+		argbuf[0] = 0;
+		for (i = 0; i < n_arg; i++)
+			len += sprintf(argbuf + len, i ? ", %d" : "%d",
+					args[i]);
+		if (res && res->type == LENSL_ACPI_INTEGER)
+			vdbg_printk(LENSL_DEBUG, "ACPI : %s(%s) == %d\n",
+				pathname, argbuf, res->integer);
+		else if (res && res->type != LENSL_ACPI_NONE)
+			vdbg_printk(LENSL_DEBUG, "ACPI : %s(%s) == [%d]\n",
+				pathname, argbuf, res->count);
+		else
+			vdbg_printk(LENSL_DEBUG, "ACPI : %s(%s)\n",
+				pathname, argbuf);
+	}
+	return 0;
+}
+
+static int lensl_acpi_int_func(acpi_handle handle, char *pathname, int *ret,
+				int n_arg, ...)
+{
+	struct lensl_acpi_result res = { .type = LENSL_ACPI_INTEGER };
+	int args[LENSL_MAX_ACPI_ARGS];
+	int i, err;
+	va_list ap;
+
+	if (n_arg < 0 || n_arg > LENSL_MAX_ACPI_ARGS)
+		return -EINVAL;
+	va_start(ap, n_arg);
+	for (i = 0; i < n_arg; i++)
+		args[i] = va_arg(ap, int);
+	va_end(ap);
+
+	err = lensl_acpi_typed_func(handle, pathname, ret ? &res : NULL,
+			n_arg, args);
+	if (!err && ret)
+		*ret = res.integer;
+	return err;
 }
 
 /*************************************************************************
-    LEDs
+    Bluetooth, WWAN, UWB
  *************************************************************************/
 
-#ifdef CONFIG_NEW_LEDS
+enum {
+	/* ACPI GBDC/SBDC, GWAN/SWAN, GUWB/SUWB bits */
+	LENSL_RADIO_HWPRESENT	= 0x01, /* hardware is available */
+	LENSL_RADIO_RADIOSSW	= 0x02, /* radio is enabled */
+	LENSL_RADIO_RESUMECTRL	= 0x04, /* state at resume: off/last state */
+};
 
-#define LENSL_LED_TV_OFF   0
-#define LENSL_LED_TV_ON    0x02
-#define LENSL_LED_TV_BLINK 0x01
-#define LENSL_LED_TV_DIM   0x100
+static inline int get_wlsw(int *value)
+{
+	return lensl_acpi_int_func(lensl->hkey_handle, "WLSW", value, 0);
+}
 
-/* equivalent to the ThinkVantage LED on other ThinkPads */
-#define LENSL_LED_TV_NAME "lensl::lenovocare"
+static inline int get_gbdc(int *value)
+{
+	return lensl_acpi_int_func(lensl->hkey_handle, "GBDC", value, 0);
+}
 
-struct {
-	struct led_classdev cdev;
-	enum led_brightness brightness;
-	int supported, new_code;
-	struct work_struct work;
-} led_tv;
+static inline int get_gwan(int *value)
+{
+	return lensl_acpi_int_func(lensl->hkey_handle, "GWAN", value, 0);
+}
 
-static inline int set_tvls(int code)
+#if LENSL_CONFIG_UWB
+static inline int get_guwb(int *value)
 {
-	return lensl_acpi_int_func(hkey_handle, "TVLS", NULL, 1, code);
+	return lensl_acpi_int_func(lensl->hkey_handle, "GUWB", value, 0);
 }
+#endif
 
-static void led_tv_worker(struct work_struct *work)
+static inline int set_sbdc(int value)
 {
-	if (!led_tv.supported)
-		return;
-	set_tvls(led_tv.new_code);
-	if (led_tv.new_code)
-		led_tv.brightness = LED_FULL;
-	else
-		led_tv.brightness = LED_OFF;
+	return lensl_acpi_int_func(lensl->hkey_handle, "SBDC", NULL, 1, value);
 }
 
-static void led_tv_brightness_set_sysfs(struct led_classdev *led_cdev,
-				enum led_brightness brightness)
+static inline int set_swan(int value)
 {
-	switch (brightness) {
-	case LED_OFF:
-		led_tv.new_code = LENSL_LED_TV_OFF;
-		break;
-	case LED_FULL:
-		led_tv.new_code = LENSL_LED_TV_ON;
-		break;
-	default:
-		return;
-	}
-	queue_work(lensl_wq, &led_tv.work);
+	return lensl_acpi_int_func(lensl->hkey_handle, "SWAN", NULL, 1, value);
 }
 
-static enum led_brightness led_tv_brightness_get_sysfs(
-					struct led_classdev *led_cdev)
+#if LENSL_CONFIG_UWB
+static inline int set_suwb(int value)
 {
-	return led_tv.brightness;
+	return lensl_acpi_int_func(lensl->hkey_handle, "SUWB", NULL, 1, value);
 }
+#endif
 
-static int led_tv_blink_set_sysfs(struct led_classdev *led_cdev,
-			unsigned long *delay_on, unsigned long *delay_off)
+static int lensl_radio_get(struct lensl_radio *radio, int *hw_blocked,
+				int *value)
 {
-	if (*delay_on == 0 && *delay_off == 0) {
-		/* If we can choose the flash rate, use dimmed blinking --
-		   it looks better */
-		led_tv.new_code = LENSL_LED_TV_ON |
-			LENSL_LED_TV_BLINK | LENSL_LED_TV_DIM;
-		*delay_on = 2000;
-		*delay_off = 2000;
-	} else if (*delay_on + *delay_off == 4000) {
-		/* User wants dimmed blinking */
-		led_tv.new_code = LENSL_LED_TV_ON |
-			LENSL_LED_TV_BLINK | LENSL_LED_TV_DIM;
-	} else if (*delay_on == 7250 && *delay_off == 500) {
-		/* User wants standard blinking mode */
-		led_tv.new_code = LENSL_LED_TV_ON | LENSL_LED_TV_BLINK;
-	} else
+	int wlsw;
+
+	*hw_blocked = 0;
+	if (!radio)
 		return -EINVAL;
-	queue_work(lensl_wq, &led_tv.work);
+	if (!radio->present)
+		return -ENODEV;
+	if (!get_wlsw(&wlsw) && !wlsw)
+		*hw_blocked = 1;
+	if (radio->get_acpi(value))
+		return -EIO;
 	return 0;
 }
 
-static void led_exit(void)
+/* serializes radio state changes, so that a multi-radio operation is
+   not interleaved with writes from rfkill or the ioctl interface */
+static DEFINE_MUTEX(lensl_radio_mutex);
+
+static int lensl_radio_set_on(struct lensl_radio *radio, int *hw_blocked,
+				bool on)
 {
-	if (led_tv.supported) {
-		led_classdev_unregister(&led_tv.cdev);
-		led_tv.supported = 0;
-		set_tvls(LENSL_LED_TV_OFF);
+	int value, ret;
+
+	mutex_lock(&lensl_radio_mutex);
+	if ((ret = lensl_radio_get(radio, hw_blocked, &value)) < 0)
+		goto out;
+	/* WLSW overrides radio in firmware/hardware, but there is
+	   no reason to risk weird behaviour. */
+	if (*hw_blocked)
+		goto out;
+	if (on)
+		value |= LENSL_RADIO_RADIOSSW;
+	else
+		value &= ~LENSL_RADIO_RADIOSSW;
+	if (radio->set_acpi(value)) {
+		ret = -EIO;
+		goto out;
 	}
+	lensl_event(LENSL_EVENT_RADIO, radio->type, on);
+out:
+	mutex_unlock(&lensl_radio_mutex);
+	return ret;
 }
 
-static int led_init(void)
+/* Bluetooth/WWAN/UWB rfkill interface */
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30)
+
+static int lensl_radio_rfkill_get_state(void *data, enum rfkill_state *state)
+{
+	int ret, value, hw_blocked = 0;
+	ret = lensl_radio_get((struct lensl_radio *)data,
+		&hw_blocked, &value);
+
+	if (hw_blocked) {
+		*state = RFKILL_STATE_HARD_BLOCKED;
+		return 0;
+	}
+
+	if (ret)
+		return ret;
+
+	if (value & LENSL_RADIO_RADIOSSW)
+		*state = RFKILL_STATE_UNBLOCKED;
+	else
+		*state = RFKILL_STATE_SOFT_BLOCKED;
+	return 0;
+}
+
+static int lensl_radio_rfkill_toggle_radio(void *data, enum rfkill_state state)
+{
+	int ret, value, hw_blocked = 0;
+	ret = lensl_radio_get((struct lensl_radio *)data,
+		&hw_blocked, &value);
+
+	if (state == RFKILL_STATE_UNBLOCKED) {
+		if (hw_blocked)
+			return -EPERM;
+		if (ret)
+			return ret;
+		value = 1;
+	} else {
+		if (ret && !hw_blocked)
+			return ret;
+		value = 0;
+	}
+
+	ret = lensl_radio_set_on((struct lensl_radio *)data,
+		&hw_blocked, value);
+
+	if (hw_blocked)
+		return 0;
+	return ret;
+}
+
+static int lensl_radio_new_rfkill(struct lensl_radio *radio,
+			struct rfkill **rfk, bool sw_blocked,
+			bool hw_blocked)
 {
 	int res;
 
-	memset(&led_tv, 0, sizeof(led_tv));
-	led_tv.cdev.brightness_get = led_tv_brightness_get_sysfs;
-	led_tv.cdev.brightness_set = led_tv_brightness_set_sysfs;
-	led_tv.cdev.blink_set = led_tv_blink_set_sysfs;
-	led_tv.cdev.name = LENSL_LED_TV_NAME;
-	INIT_WORK(&led_tv.work, led_tv_worker);
-	set_tvls(LENSL_LED_TV_OFF);
-	res = led_classdev_register(&lensl_pdev->dev, &led_tv.cdev);
-	if (res) {
-		vdbg_printk(LENSL_WARNING, "Failed to register LED device\n");
+	*rfk = rfkill_allocate(&lensl_pdev->dev, radio->rfktype);
+	if (!*rfk) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to allocate memory for rfkill class\n");
+		return -ENOMEM;
+	}
+
+	(*rfk)->name = radio->rfkname;
+	(*rfk)->get_state = lensl_radio_rfkill_get_state;
+	(*rfk)->toggle_radio = lensl_radio_rfkill_toggle_radio;
+	(*rfk)->data = radio;
+
+	if (hw_blocked)
+		(*rfk)->state = RFKILL_STATE_HARD_BLOCKED;
+	else if (sw_blocked)
+		(*rfk)->state = RFKILL_STATE_SOFT_BLOCKED;
+	else
+		(*rfk)->state = RFKILL_STATE_UNBLOCKED;
+
+	res = rfkill_register(*rfk);
+	if (res < 0) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to register %s rfkill switch: %d\n",
+			radio->rfkname, res);
+		rfkill_free(*rfk);
+		*rfk = NULL;
 		return res;
 	}
-	led_tv.supported = 1;
-	vdbg_printk(LENSL_DEBUG, "Initialized LED subdriver\n");
+
 	return 0;
 }
 
-#else /* CONFIG_NEW_LEDS */
+#else
 
-static void led_exit(void)
+static void lensl_radio_rfkill_query(struct rfkill *rfk, void *data)
 {
+	int ret, value = 0;
+	ret = get_wlsw(&value);
+	if (ret)
+		return;
+	rfkill_set_hw_state(rfk, !value);
 }
 
-static int led_init(void)
+static int lensl_radio_rfkill_set_block(void *data, bool blocked)
 {
-	return -ENODEV;
+	int ret, hw_blocked = 0;
+	ret = lensl_radio_set_on((struct lensl_radio *)data,
+		&hw_blocked, !blocked);
+	/* rfkill spec: just return 0 on hard block */
+	return ret;
 }
 
-#endif /* CONFIG_NEW_LEDS */
+static struct rfkill_ops rfkops = {
+	NULL,
+	lensl_radio_rfkill_query,
+	lensl_radio_rfkill_set_block,
+};
 
-/*************************************************************************
-    hwmon & fans
- *************************************************************************/
+static int lensl_radio_new_rfkill(struct lensl_radio *radio,
+			struct rfkill **rfk, bool sw_blocked,
+			bool hw_blocked)
+{
+	int res;		
+		
+	*rfk = rfkill_alloc(radio->rfkname, &lensl_pdev->dev, radio->rfktype,
+			&rfkops, radio);
+	if (!*rfk) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to allocate memory for rfkill class\n");
+		return -ENOMEM;
+	}
 
-static struct device *lensl_hwmon_device;
-/* we do not have a reliable way of reading it from ACPI */
-static int pwm1_value = -1;
-/* corresponds to ~2700 rpm */
-#define DEFAULT_PWM1 126
+	rfkill_set_hw_state(*rfk, hw_blocked);
+	rfkill_set_sw_state(*rfk, sw_blocked);
 
-static inline int get_tach(int *value, int fan)
-{
-	return lensl_acpi_int_func(ec0_handle, "TACH", value, 1, fan);
+	res = rfkill_register(*rfk);
+	if (res < 0) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to register %s rfkill switch: %d\n",
+			radio->rfkname, res);
+		rfkill_destroy(*rfk);
+		*rfk = NULL;
+		return res;
+	}
+
+	return 0;
+}
+
+#endif /* LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30) */
+
+/* tell the rfkill core about a state change it did not request */
+static void lensl_radio_sync_rfkill(struct lensl_radio *radio, bool on)
+{
+	if (!radio->rfk)
+		return;
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30)
+	rfkill_force_state(radio->rfk,
+		on ? RFKILL_STATE_UNBLOCKED : RFKILL_STATE_SOFT_BLOCKED);
+#else
+	rfkill_set_sw_state(radio->rfk, !on);
+#endif
+}
+
+/* Bluetooth/WWAN/UWB init and exit */
+
+/* copied into lensl->radios by lensl_probe() */
+static const struct lensl_radio lensl_radio_templates[LENSL_RADIO_COUNT] = {
+	{
+		LENSL_BLUETOOTH,
+		RFKILL_TYPE_BLUETOOTH,
+		0,
+		"bluetooth",
+		"lensl_bluetooth_sw",
+		NULL,
+		get_gbdc,
+		set_sbdc,
+		&bluetooth_auto_enable,
+	},
+	{
+		LENSL_WWAN,
+		RFKILL_TYPE_WWAN,
+		0,
+		"WWAN",
+		"lensl_wwan_sw",
+		NULL,
+		get_gwan,
+		set_swan,
+		&wwan_auto_enable,
+	},
+#if LENSL_CONFIG_UWB
+	{
+		LENSL_UWB,
+		RFKILL_TYPE_UWB,
+		0,
+		"UWB",
+		"lensl_uwb_sw",
+		NULL,
+		get_guwb,
+		set_suwb,
+		&uwb_auto_enable,
+	},
+#endif
+};
+
+static int lensl_radios_present(void)
+{
+	int i;
+
+	for (i = 0; i < LENSL_RADIO_COUNT; i++)
+		if (lensl->radios[i].present)
+			return 1;
+	return 0;
+}
+
+/* push a new hardware switch state into the rfkill core, which notifies
+   userspace */
+static void lensl_radio_notify_wlsw(int wlsw)
+{
+	int i;
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30)
+	enum rfkill_state state;
+#endif
+
+	for (i = 0; i < LENSL_RADIO_COUNT; i++) {
+		if (!lensl->radios[i].rfk)
+			continue;
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,30)
+		if (lensl_radio_rfkill_get_state(&lensl->radios[i], &state))
+			continue;
+		rfkill_force_state(lensl->radios[i].rfk, state);
+#else
+		rfkill_set_hw_state(lensl->radios[i].rfk, !wlsw);
+#endif
+	}
+}
+
+/* multi-radio operations */
+
+enum {
+	LENSL_RADIOS_OFF,
+	LENSL_RADIOS_ON,
+	LENSL_RADIOS_TOGGLE,	/* all off if any is on, otherwise all on */
+	LENSL_RADIOS_CYCLE,	/* step through every on/off combination */
+};
+
+/* Switch all present radios in one serialized pass. Setting them one by
+   one through lensl_radio_set_on() costs a WLSW, a G* and an S* call per
+   radio; here WLSW is read once, each G* once, and S* only for the radios
+   whose state actually changes. Per-radio results are left in
+   lensl->radios_last[]; returns the first error, or 0. */
+static int lensl_radios_apply(int op)
+{
+	int i, wlsw, on, res = 0;
+	int value[LENSL_RADIO_COUNT];
+	unsigned int usable = 0, cur = 0, target, changed = 0;
+	struct lensl_radio *radio;
+
+	mutex_lock(&lensl_radio_mutex);
+	if (get_wlsw(&wlsw))
+		wlsw = 1; /* as in lensl_radio_get: unknown means not blocked */
+	for (i = 0; i < LENSL_RADIO_COUNT; i++) {
+		radio = &lensl->radios[i];
+		if (!radio->present)
+			lensl->radios_last[i].result = -ENODEV;
+		else if (!wlsw)
+			lensl->radios_last[i].result = -EPERM;
+		else if (radio->get_acpi(&value[i]))
+			lensl->radios_last[i].result = -EIO;
+		else {
+			lensl->radios_last[i].result = 0;
+			usable |= 1 << i;
+			if (value[i] & LENSL_RADIO_RADIOSSW)
+				cur |= 1 << i;
+		}
+	}
+	switch (op) {
+	case LENSL_RADIOS_ON:
+		target = usable;
+		break;
+	case LENSL_RADIOS_TOGGLE:
+		target = cur ? 0 : usable;
+		break;
+	case LENSL_RADIOS_CYCLE:
+		/* count up in binary over the usable radios only */
+		target = ((cur | ~usable) + 1) & usable;
+		break;
+	default:
+		target = 0;
+	}
+
+	for (i = 0; i < LENSL_RADIO_COUNT; i++) {
+		radio = &lensl->radios[i];
+		if (lensl->radios_last[i].result) {
+			if (lensl->radios_last[i].result != -ENODEV && !res)
+				res = lensl->radios_last[i].result;
+			continue;
+		}
+		on = !!(target & (1 << i));
+		lensl->radios_last[i].on = on;
+		if (!(value[i] & LENSL_RADIO_RADIOSSW) == !on)
+			continue;
+		if (on)
+			value[i] |= LENSL_RADIO_RADIOSSW;
+		else
+			value[i] &= ~LENSL_RADIO_RADIOSSW;
+		if (radio->set_acpi(value[i])) {
+			lensl->radios_last[i].result = -EIO;
+			if (!res)
+				res = -EIO;
+			continue;
+		}
+		changed |= 1 << i;
+	}
+	mutex_unlock(&lensl_radio_mutex);
+
+	/* the old rfkill core calls toggle_radio, which takes
+	   lensl_radio_mutex, with its own mutex held; rfkill_force_state
+	   takes that mutex too, so tell rfkill only after unlocking */
+	for (i = 0; i < LENSL_RADIO_COUNT; i++) {
+		if (!(changed & (1 << i)))
+			continue;
+		on = !!(target & (1 << i));
+		lensl_radio_sync_rfkill(&lensl->radios[i], on);
+		lensl_event(LENSL_EVENT_RADIO, lensl->radios[i].type, on);
+	}
+	vdbg_printk(LENSL_DEBUG, "Switched radios to 0x%x: %d\n",
+		target, res);
+	return res;
+}
+
+static void radio_exit(lensl_radio_type type)
+{
+	struct rfkill *rfk = lensl->radios[type].rfk;
+
+	lensl->radios[type].present = 0;
+	if (!rfk)
+		return;
+	rfkill_unregister(rfk);
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,30)
+	rfkill_destroy(rfk);
+#endif
+	lensl->radios[type].rfk = NULL;
+}
+
+static int radio_init(lensl_radio_type type)
+{
+	int value, res, hw_blocked = 0, sw_blocked;
+
+	if (!lensl->hkey_handle)
+		return -ENODEV;
+	lensl->radios[type].present = 1; /* need for lensl_radio_get */
+	res = lensl_radio_get(&lensl->radios[type], &hw_blocked, &value);
+	lensl->radios[type].present = 0;
+	if (res && !hw_blocked)
+		return -EIO;
+	if (!(value & LENSL_RADIO_HWPRESENT))
+		return -ENODEV;
+	lensl->radios[type].present = 1;
+
+	if (*lensl->radios[type].auto_enable) {
+		sw_blocked = 0;
+		value |= LENSL_RADIO_RADIOSSW;
+		lensl->radios[type].set_acpi(value);
+	} else {
+		sw_blocked = 1;
+		value &= ~LENSL_RADIO_RADIOSSW;
+		lensl->radios[type].set_acpi(value);
+	}
+
+	res = lensl_radio_new_rfkill(&lensl->radios[type],
+			&lensl->radios[type].rfk, sw_blocked, hw_blocked);
+
+	if (res) {
+		radio_exit(type);
+		return res;
+	}
+	vdbg_printk(LENSL_DEBUG, "Initialized %s subdriver\n",
+		lensl->radios[type].name);
+
+	return 0;
+}
+
+/*************************************************************************
+    backlight control - based on video.c
+ *************************************************************************/
+
+/* NB: the reason why this needs to be implemented here is that the SL series
+   uses the ACPI interface for controlling the backlight in a non-standard
+   manner. See http://bugzilla.kernel.org/show_bug.cgi?id=12249  */
+
+#if LENSL_CONFIG_BACKLIGHT
+
+/* runs backlight_reload_work apart from the telemetry works on lensl_wq */
+static struct workqueue_struct *backlight_wq;
+
+/* The brightness level table is published through RCU: the hotkey and
+   sysfs paths read it locklessly, while a reload (on an LCDD notify)
+   fills the table that is not published, swaps it in under
+   backlight_levels_mutex and waits for a grace period before the old
+   one can be filled again. The two tables are static, so a reload
+   allocates nothing. */
+struct lensl_bcl {
+	int count;
+	int values[LENSL_BCL_MAX];
+};
+static struct lensl_bcl backlight_bcl[2];
+static DEFINE_MUTEX(backlight_levels_mutex);
+
+/* called with backlight_levels_mutex held; the table returned is not
+   published */
+static int get_bcl(struct lensl_bcl **levels)
+{
+	struct lensl_acpi_result res = { .type = LENSL_ACPI_PACKAGE };
+	struct lensl_bcl *bcl;
+	int status;
+
+	if (!levels)
+		return -EINVAL;
+	*levels = NULL;
+
+	bcl = lensl->backlight_levels == &backlight_bcl[0] ?
+		&backlight_bcl[1] : &backlight_bcl[0];
+	res.data = bcl->values;
+	res.size = ARRAY_SIZE(bcl->values);
+
+	/* _BCL returns an array sorted from high to low; the first two values
+	   are *not* special (non-standard behavior) */
+	status = lensl_acpi_typed_func(lensl->lcdd_handle, "_BCL", &res, 0,
+			NULL);
+	if (status) {
+		vdbg_printk(LENSL_ERR, "Invalid _BCL data\n");
+		return status;
+	}
+	bcl->count = res.count;
+	/* the table used to be allocated on every reload too */
+	lensl_acpi_count_alloc(1);
+	*levels = bcl;
+	return 0;
+}
+
+/* number of brightness levels, 0 if unknown */
+static int lensl_bd_count(void)
+{
+	struct lensl_bcl *levels;
+	int count = 0;
+
+	rcu_read_lock();
+	levels = rcu_dereference(lensl->backlight_levels);
+	if (levels)
+		count = levels->count;
+	rcu_read_unlock();
+	return count;
+}
+
+/* Publish a new level table and the matching max_brightness. The
+   backlight core checks max_brightness under ops_lock, so taking it here
+   means a sysfs write sees either the old table and limit or the new
+   ones, never a mix. */
+static void backlight_set_levels(struct lensl_bcl *levels)
+{
+	struct backlight_device *bd = lensl->backlight;
+	struct lensl_bcl *old;
+
+	if (bd)
+		mutex_lock(&bd->ops_lock);
+	old = lensl->backlight_levels;
+	rcu_assign_pointer(lensl->backlight_levels, levels);
+	if (bd) {
+		bd->props.max_brightness = levels ? levels->count - 1 : 0;
+		if (bd->props.brightness > bd->props.max_brightness)
+			bd->props.brightness = bd->props.max_brightness;
+		mutex_unlock(&bd->ops_lock);
+	}
+	/* old may be filled by the next reload */
+	if (old)
+		synchronize_rcu();
+}
+
+static void backlight_reload_worker(struct work_struct *work)
+{
+	struct lensl_bcl *levels;
+
+	mutex_lock(&backlight_levels_mutex);
+	if (!get_bcl(&levels) && levels->count) {
+		backlight_set_levels(levels);
+		vdbg_printk(LENSL_DEBUG,
+			"Reloaded %d brightness levels\n", levels->count);
+		if (lensl->backlight)
+			sysfs_notify(&lensl->backlight->dev.kobj, NULL,
+				"max_brightness");
+	}
+	mutex_unlock(&backlight_levels_mutex);
+}
+
+static DECLARE_WORK(backlight_reload_work, backlight_reload_worker);
+
+static void lensl_lcdd_notify(acpi_handle handle, u32 event, void *data)
+{
+	/* 0x85 .. 0x89 are brightness change notifications, which do not
+	   change the level table; anything else (dock/undock, a different
+	   panel) may */
+	if (event >= 0x85 && event <= 0x89)
+		return;
+	queue_work(backlight_wq, &backlight_reload_work);
+}
+
+static inline int set_bcm(int level)
+{
+	/* standard behavior */
+	return lensl_acpi_int_func(lensl->lcdd_handle, "_BCM", NULL, 1, level);
+}
+
+static inline int get_bqc(int *level)
+{
+	/* returns an index from the bottom into the _BCL package
+	   (non-standard behavior) */
+	return lensl_acpi_int_func(lensl->lcdd_handle, "_BQC", level, 0);
+}
+
+/* backlight device sysfs support */
+static int lensl_bd_get_brightness(struct backlight_device *bd)
+{
+	int level = 0;
+
+	if (get_bqc(&level))
+		return 0;
+
+	return level;
+}
+
+static int lensl_bd_set_brightness_int(int request_level)
+{
+	struct lensl_bcl *levels;
+	int n, value = -1, res;
+
+	rcu_read_lock();
+	levels = rcu_dereference(lensl->backlight_levels);
+	if (levels) {
+		n = (levels->count - 1) * lensl->backlight_cap_pct / 100;
+		if (request_level > n)
+			request_level = n;
+		n = levels->count - request_level - 1;
+		if (n >= 0 && n < levels->count)
+			value = levels->values[n];
+	}
+	rcu_read_unlock();
+	if (value < 0)
+		return -EINVAL;
+
+	res = set_bcm(value);
+	if (!res)
+		lensl_event(LENSL_EVENT_BACKLIGHT, 0, request_level);
+	return res;
+}
+
+/* keep the backlight class in sync with a level change and wake up
+   anyone polling on its attributes */
+static void lensl_bd_notify(int level)
+{
+	if (!lensl->backlight)
+		return;
+	lensl->backlight->props.brightness = level;
+	sysfs_notify(&lensl->backlight->dev.kobj, NULL, "actual_brightness");
+	sysfs_notify(&lensl->backlight->dev.kobj, NULL, "brightness");
+}
+
+static int lensl_bd_set_brightness(struct backlight_device *bd)
+{
+	if (!bd)
+		return -EINVAL;
+
+	return lensl_bd_set_brightness_int(bd->props.brightness);
+}
+
+/* step the brightness by delta levels, as done by the brightness hotkeys;
+   returns -ENODEV if we are not controlling the backlight */
+static int lensl_bd_step(int delta)
+{
+	int level;
+
+	if (!control_backlight || !lensl->backlight)
+		return -ENODEV;
+	level = lensl_bd_get_brightness(lensl->backlight) + delta;
+	if (level >= 0 && level < lensl_bd_count())
+		lensl_bd_set_brightness_int(level);
+	return 0;
+}
+
+static int lensl_bd_get_level(int *level)
+{
+	if (!lensl->backlight)
+		return -ENODEV;
+	*level = lensl_bd_get_brightness(backlight);
+	return 0;
+}
+
+static int lensl_bd_set_level(int level)
+{
+	if (!lensl->backlight)
+		return -ENODEV;
+	return lensl_bd_set_brightness_int(level);
+}
+
+/* limit the brightness to pct percent of the top level, lowering the
+   current brightness if needed */
+static void lensl_bd_set_cap(int pct)
+{
+	lensl->backlight_cap_pct = pct;
+	if (lensl->backlight)
+		lensl_bd_set_brightness_int(
+			lensl_bd_get_brightness(lensl->backlight));
+}
+
+static struct backlight_ops lensl_backlight_ops = {
+	.get_brightness = lensl_bd_get_brightness,
+	.update_status  = lensl_bd_set_brightness,
+};
+
+static void backlight_exit(void)
+{
+	if (lensl->backlight_notify_installed) {
+		acpi_remove_notify_handler(lensl->lcdd_handle,
+					ACPI_DEVICE_NOTIFY, lensl_lcdd_notify);
+		lensl->backlight_notify_installed = 0;
+	}
+	if (backlight_wq) {
+		cancel_work_sync(&backlight_reload_work);
+		destroy_workqueue(backlight_wq);
+		backlight_wq = NULL;
+	}
+	backlight_device_unregister(lensl->backlight);
+	lensl->backlight = NULL;
+	backlight_set_levels(NULL);
+}
+
+static int backlight_init(void)
+{
+	int status = 0;
+	struct lensl_bcl *levels;
+
+	lensl->lcdd_handle = NULL;
+	lensl->backlight = NULL;
+	lensl->backlight_levels = NULL;
+	lensl->backlight_notify_installed = 0;
+
+	status = acpi_get_handle(NULL, LENSL_LCDD, &lensl->lcdd_handle);
+	if (ACPI_FAILURE(status)) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to get ACPI handle for %s\n", LENSL_LCDD);
+		return -EIO;
+	}
+
+	status = get_bcl(&levels);
+	if (status || !levels->count)
+		goto err;
+	backlight_set_levels(levels);
+
+	lensl->backlight = backlight_device_register(LENSL_BACKLIGHT_NAME,
+			NULL, NULL, &lensl_backlight_ops);
+	if (IS_ERR(lensl->backlight)) {
+		status = PTR_ERR(lensl->backlight);
+		lensl->backlight = NULL;
+		goto err;
+	}
+	lensl->backlight->props.max_brightness = levels->count - 1;
+	lensl->backlight->props.brightness =
+		lensl_bd_get_brightness(lensl->backlight);
+
+	/* video.c may already own the LCDD notifications, in which case
+	   the level table is simply not reloaded */
+	backlight_wq = create_singlethread_workqueue(
+			LENSL_BACKLIGHT_WORKQUEUE_NAME);
+	if (backlight_wq &&
+	    ACPI_SUCCESS(acpi_install_notify_handler(lensl->lcdd_handle,
+			ACPI_DEVICE_NOTIFY, lensl_lcdd_notify, NULL)))
+		lensl->backlight_notify_installed = 1;
+	else
+		vdbg_printk(LENSL_DEBUG,
+			"Could not install %s notify handler\n", LENSL_LCDD);
+	vdbg_printk(LENSL_INFO, "Started backlight brightness control\n");
+	goto out;
+err:
+	backlight_set_levels(NULL);
+	vdbg_printk(LENSL_ERR,
+		"Failed to start backlight brightness control\n");
+out:
+	return status;
+}
+
+#else /* LENSL_CONFIG_BACKLIGHT */
+
+static int lensl_bd_step(int delta)
+{
+	return -ENODEV;
+}
+
+static void lensl_bd_notify(int level)
+{
+}
+
+static int lensl_bd_get_level(int *level)
+{
+	return -ENODEV;
+}
+
+static int lensl_bd_set_level(int level)
+{
+	return -ENODEV;
+}
+
+static void lensl_bd_set_cap(int pct)
+{
+}
+
+static void backlight_exit(void)
+{
+}
+
+static int backlight_init(void)
+{
+	return -ENODEV;
+}
+
+#endif /* LENSL_CONFIG_BACKLIGHT */
+
+/*************************************************************************
+    LEDs
+ *************************************************************************/
+
+#if defined(CONFIG_NEW_LEDS) && LENSL_CONFIG_LEDS
+
+#define LENSL_LED_TV_OFF   0
+#define LENSL_LED_TV_ON    0x02
+#define LENSL_LED_TV_BLINK 0x01
+#define LENSL_LED_TV_DIM   0x100
+
+/* equivalent to the ThinkVantage LED on other ThinkPads */
+#define LENSL_LED_TV_NAME "lensl::lenovocare"
+
+static inline int set_tvls(int code)
+{
+	return lensl_acpi_int_func(lensl->hkey_handle, "TVLS", NULL, 1, code);
+}
+
+/* LED state as seen by the character device: 0 = off, 1 = on, 2 = blink */
+static int led_tv_state(int code)
+{
+	if (code & LENSL_LED_TV_BLINK)
+		return 2;
+	return code ? 1 : 0;
+}
+
+static void led_tv_worker(struct work_struct *work)
+{
+	int code;
+
+	lensl_cost_wakeup(LENSL_WAKE_LED);
+	if (!lensl->led_tv.supported)
+		return;
+	code = lensl->led_tv.new_code;
+	if (set_tvls(code))
+		return;
+	if (code)
+		lensl->led_tv.brightness = LED_FULL;
+	else
+		lensl->led_tv.brightness = LED_OFF;
+	if (code != lensl->led_tv.code) {
+		lensl->led_tv.code = code;
+		lensl_event(LENSL_EVENT_LED, 0, led_tv_state(code));
+	}
+}
+
+static void led_tv_brightness_set_sysfs(struct led_classdev *led_cdev,
+				enum led_brightness brightness)
+{
+	switch (brightness) {
+	case LED_OFF:
+		lensl->led_tv.new_code = LENSL_LED_TV_OFF;
+		break;
+	case LED_FULL:
+		lensl->led_tv.new_code = LENSL_LED_TV_ON;
+		break;
+	default:
+		return;
+	}
+	queue_work(lensl_wq, &lensl->led_tv.work);
+}
+
+static enum led_brightness led_tv_brightness_get_sysfs(
+					struct led_classdev *led_cdev)
+{
+	return lensl->led_tv.brightness;
+}
+
+static int led_tv_blink_set_sysfs(struct led_classdev *led_cdev,
+			unsigned long *delay_on, unsigned long *delay_off)
+{
+	if (*delay_on == 0 && *delay_off == 0) {
+		/* If we can choose the flash rate, use dimmed blinking --
+		   it looks better */
+		lensl->led_tv.new_code = LENSL_LED_TV_ON |
+			LENSL_LED_TV_BLINK | LENSL_LED_TV_DIM;
+		*delay_on = 2000;
+		*delay_off = 2000;
+	} else if (*delay_on + *delay_off == 4000) {
+		/* User wants dimmed blinking */
+		lensl->led_tv.new_code = LENSL_LED_TV_ON |
+			LENSL_LED_TV_BLINK | LENSL_LED_TV_DIM;
+	} else if (*delay_on == 7250 && *delay_off == 500) {
+		/* User wants standard blinking mode */
+		lensl->led_tv.new_code = LENSL_LED_TV_ON | LENSL_LED_TV_BLINK;
+	} else
+		return -EINVAL;
+	queue_work(lensl_wq, &lensl->led_tv.work);
+	return 0;
+}
+
+static int lensl_led_get(int *state)
+{
+	if (!lensl->led_tv.supported)
+		return -ENODEV;
+	*state = led_tv_state(lensl->led_tv.code);
+	return 0;
+}
+
+static int lensl_led_set(int state)
+{
+	if (!lensl->led_tv.supported)
+		return -ENODEV;
+	switch (state) {
+	case 0:
+		lensl->led_tv.new_code = LENSL_LED_TV_OFF;
+		break;
+	case 1:
+		lensl->led_tv.new_code = LENSL_LED_TV_ON;
+		break;
+	case 2:
+		lensl->led_tv.new_code = LENSL_LED_TV_ON |
+			LENSL_LED_TV_BLINK | LENSL_LED_TV_DIM;
+		break;
+	default:
+		return -EINVAL;
+	}
+	queue_work(lensl_wq, &lensl->led_tv.work);
+	return 0;
+}
+
+static void led_exit(void)
+{
+	if (lensl->led_tv.supported) {
+		led_classdev_unregister(&lensl->led_tv.cdev);
+		lensl->led_tv.supported = 0;
+		/* the worker needs the device state that goes away with
+		   the platform device */
+		cancel_work_sync(&lensl->led_tv.work);
+		set_tvls(LENSL_LED_TV_OFF);
+	}
+}
+
+static int led_init(void)
+{
+	int res;
+
+	memset(&lensl->led_tv, 0, sizeof(lensl->led_tv));
+	lensl->led_tv.cdev.brightness_get = led_tv_brightness_get_sysfs;
+	lensl->led_tv.cdev.brightness_set = led_tv_brightness_set_sysfs;
+	lensl->led_tv.cdev.blink_set = led_tv_blink_set_sysfs;
+	lensl->led_tv.cdev.name = LENSL_LED_TV_NAME;
+	INIT_WORK(&lensl->led_tv.work, led_tv_worker);
+	set_tvls(LENSL_LED_TV_OFF);
+	res = led_classdev_register(&lensl_pdev->dev, &lensl->led_tv.cdev);
+	if (res) {
+		vdbg_printk(LENSL_WARNING, "Failed to register LED device\n");
+		return res;
+	}
+	lensl->led_tv.supported = 1;
+	vdbg_printk(LENSL_DEBUG, "Initialized LED subdriver\n");
+	return 0;
+}
+
+#else /* CONFIG_NEW_LEDS && LENSL_CONFIG_LEDS */
+
+static int lensl_led_get(int *state)
+{
+	return -ENODEV;
+}
+
+static int lensl_led_set(int state)
+{
+	return -ENODEV;
+}
+
+static void led_exit(void)
+{
+}
+
+static int led_init(void)
+{
+	return -ENODEV;
+}
+
+#endif /* CONFIG_NEW_LEDS && LENSL_CONFIG_LEDS */
+
+/*************************************************************************
+    hwmon & fans
+ *************************************************************************/
+
+/* pwm1 writes are write-behind: the new duty is taken at once and
+   fan_write_work hands it to SFNV after fan_write_delay, so a burst of
+   writes costs one firmware call with the latest value. The tracked
+   fan_mode_seen also spares the DECF read that used to precede each
+   write; the worker still reads DECF once before SFNV, since the mode
+   may have changed behind our back since it was last seen. A write
+   that does not reach the firmware rolls pwm1_value back to
+   pwm1_committed. fan_write_pending and the counters are under
+   fan_mutex. */
+static void fan_write_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(fan_write_work, fan_write_worker);
+/* corresponds to ~2700 rpm */
+#define DEFAULT_PWM1 126
+
+static inline int get_tach(int *value, int fan)
+{
+	return lensl_acpi_int_func(lensl->ec0_handle, "TACH", value, 1, fan);
+}
+
+static inline int get_decf(int *value)
+{
+	return lensl_acpi_int_func(lensl->ec0_handle, "DECF", value, 0);
+}
+
+/* speed must be in range 0 .. 255 */
+static inline int set_sfnv(int action, int speed)
+{
+	return lensl_acpi_int_func(lensl->ec0_handle, "SFNV", NULL, 2,
+			action, speed);
+}
+
+static int pwm1_enable_get_current(void)
+{
+	int res;
+	int value;
+
+	res = get_decf(&value);
+	if (res)
+		return res;
+	if (value & 1)
+		return 1;
+	return 0;
+}
+
+static void hwmon_notify(char *attr, bool uevent)
+{
+	if (!lensl->hwmon_device)
+		return;
+	sysfs_notify(&lensl->hwmon_device->kobj, NULL, attr);
+	if (uevent)
+		kobject_uevent(&lensl->hwmon_device->kobj, KOBJ_CHANGE);
+}
+
+/* Take note of a fan state read by the watch or by the sampler (mode or
+   rpm < 0 if the read failed): report mode changes and significant
+   speed changes, and evaluate the fan1_min/fan1_max alarms. */
+static int fan_read_duty(void)
+{
+	u8 duty;
+
+	if (fan_reg < 0 || lensl_ec_read(LENSL_EC_TELEMETRY, fan_reg, &duty))
+		return -1;
+	return duty;
+}
+
+static void lensl_fan_observe(int mode, int rpm)
+{
+	int alarms = 0, changed, duty;
+
+	duty = fan_read_duty();
+	mutex_lock(&lensl->fan_mutex);
+	if (mode >= 0 && mode != lensl->fan_mode_seen) {
+		if (lensl->fan_mode_seen >= 0)
+			lensl_event(LENSL_EVENT_FAN_MODE, 0, mode);
+		lensl->fan_mode_seen = mode;
+	}
+	/* the firmware changes the duty on its own in automatic mode */
+	if (duty >= 0 && !lensl->fan_write_pending &&
+	    duty != lensl->pwm1_value) {
+		lensl->pwm1_value = lensl->pwm1_committed = duty;
+		lensl_event(LENSL_EVENT_FAN_PWM, 0, duty);
+	}
+	mutex_unlock(&lensl->fan_mutex);
+	if (rpm < 0)
+		return;
+
+	lensl_perf_sample(LENSL_PERF_FAN_RPM, rpm);
+	if (lensl->fan_rpm_seen < 0 ||
+	    abs(rpm - lensl->fan_rpm_seen) >= fan_notify_rpm) {
+		if (lensl->fan_rpm_seen >= 0)
+			lensl_event(LENSL_EVENT_FAN_RPM, 0, rpm);
+		lensl->fan_rpm_seen = rpm;
+	}
+
+	if (lensl->fan1_min && rpm < lensl->fan1_min)
+		alarms |= LENSL_FAN_ALARM_MIN;
+	if (lensl->fan1_max && rpm > lensl->fan1_max)
+		alarms |= LENSL_FAN_ALARM_MAX;
+	changed = alarms ^ lensl->fan1_alarms;
+	if (!changed)
+		return;
+	lensl->fan1_alarms = alarms;
+	if (changed & LENSL_FAN_ALARM_MIN)
+		hwmon_notify("fan1_min_alarm", false);
+	if (changed & LENSL_FAN_ALARM_MAX)
+		hwmon_notify("fan1_max_alarm", false);
+	lensl_event(LENSL_EVENT_FAN_ALARM, 0, alarms);
+}
+
+/* Fan telemetry sampler: records fan speed, pwm and mode at a fixed rate
+   into a ring that is read in bulk through debugfs fan_history, oldest
+   record first. The ring moves while it is being read, so each open of
+   the file takes a snapshot of it and reads are served from that; a
+   sysfs binary attribute cannot do this, as it has no per-open state
+   and returns at most a page per read. */
+
+#define LENSL_FAN_RING_SIZE 512
+
+static struct delayed_work fan_sample_work;
+
+static void fan_sample_worker(struct work_struct *work)
+{
+	struct lensl_fan_sample rec;
+	int mode, rpm, pwm, interval = fan_sample_interval;
+
+	lensl_cost_wakeup(LENSL_WAKE_FAN_SAMPLE);
+	mode = pwm1_enable_get_current();
+	if (get_tach(&rpm, 0))
+		rpm = -1;
+	lensl_fan_observe(mode, rpm);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.timestamp = ktime_to_ns(ktime_get());
+	if (rpm >= 0) {
+		rec.rpm = min(rpm, 0xffff);
+		rec.flags |= LENSL_FAN_SAMPLE_RPM_VALID;
+	}
+	if (mode >= 0) {
+		rec.flags |= LENSL_FAN_SAMPLE_MODE_VALID;
+		if (mode)
+			rec.flags |= LENSL_FAN_SAMPLE_MANUAL;
+	}
+	pwm = ACCESS_ONCE(lensl->pwm1_value);
+	if (pwm >= 0) {
+		rec.pwm = pwm;
+		rec.flags |= LENSL_FAN_SAMPLE_PWM_VALID;
+	}
+	if (lensl->fan1_alarms & LENSL_FAN_ALARM_MIN)
+		rec.flags |= LENSL_FAN_SAMPLE_ALARM_MIN;
+	if (lensl->fan1_alarms & LENSL_FAN_ALARM_MAX)
+		rec.flags |= LENSL_FAN_SAMPLE_ALARM_MAX;
+
+	spin_lock(&lensl->fan_ring_lock);
+	rec.seq = lensl->fan_ring_seq++;
+	lensl->fan_ring[lensl->fan_ring_head] = rec;
+	lensl->fan_ring_head = (lensl->fan_ring_head + 1) % LENSL_FAN_RING_SIZE;
+	if (lensl->fan_ring_count < LENSL_FAN_RING_SIZE)
+		lensl->fan_ring_count++;
+	spin_unlock(&lensl->fan_ring_lock);
+
+	if (interval > 0)
+		queue_delayed_work(lensl_wq, &fan_sample_work,
+				msecs_to_jiffies(interval));
+}
+
+struct fan_history_snapshot {
+	size_t len;
+	struct lensl_fan_sample recs[LENSL_FAN_RING_SIZE];
+};
+
+static int fan_history_open(struct inode *inode, struct file *file)
+{
+	struct fan_history_snapshot *snap;
+	unsigned int start, i;
+
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	spin_lock(&lensl->fan_ring_lock);
+	start = lensl->fan_ring_head + LENSL_FAN_RING_SIZE -
+		lensl->fan_ring_count;
+	for (i = 0; i < lensl->fan_ring_count; i++)
+		snap->recs[i] =
+			lensl->fan_ring[(start + i) % LENSL_FAN_RING_SIZE];
+	snap->len = lensl->fan_ring_count * sizeof(snap->recs[0]);
+	spin_unlock(&lensl->fan_ring_lock);
+	file->private_data = snap;
+	return 0;
+}
+
+static ssize_t fan_history_read(struct file *file, char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct fan_history_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos, snap->recs,
+				snap->len);
+}
+
+static int fan_history_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations fan_history_fops = {
+	.owner		= THIS_MODULE,
+	.open		= fan_history_open,
+	.read		= fan_history_read,
+	.llseek		= default_llseek,
+	.release	= fan_history_release,
+};
+
+static ssize_t update_interval_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d\n", fan_sample_interval);
+}
+
+static ssize_t update_interval_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long interval;
+	int was_running = fan_sample_interval > 0;
+
+	if (parse_strtoul(buf, 60000, &interval))
+		return -EINVAL;
+	if (interval && interval < 10)
+		return -EINVAL;
+	fan_sample_interval = interval;
+	if (interval && !was_running)
+		queue_delayed_work(lensl_wq, &fan_sample_work, 0);
+	return count;
+}
+
+static ssize_t fan1_limit_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int *limit = to_sensor_dev_attr(attr)->index ?
+		&lensl->fan1_max : &lensl->fan1_min;
+	return snprintf(buf, PAGE_SIZE, "%d\n", *limit);
+}
+
+static ssize_t fan1_limit_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	int *limit = to_sensor_dev_attr(attr)->index ?
+		&lensl->fan1_max : &lensl->fan1_min;
+	unsigned long value;
+
+	if (parse_strtoul(buf, 0xffff, &value))
+		return -EINVAL;
+	*limit = value;
+	return count;
+}
+
+static ssize_t fan1_alarm_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int mask = to_sensor_dev_attr(attr)->index;
+	return snprintf(buf, PAGE_SIZE, "%d\n", !!(lensl->fan1_alarms & mask));
+}
+
+static ssize_t fan1_input_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int res;
+	int rpm;
+
+	res = get_tach(&rpm, 0);
+	if (res)
+		return res;
+	return snprintf(buf, PAGE_SIZE, "%u\n", rpm);
+}
+
+static ssize_t pwm1_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int value = ACCESS_ONCE(lensl->pwm1_value);
+
+	if (value > -1)
+		return snprintf(buf, PAGE_SIZE, "%u\n", value);
+	return -EPERM;
+}
+
+/* called with fan_mutex held */
+static void fan_write_rollback(void)
+{
+	if (lensl->pwm1_value == lensl->pwm1_committed)
+		return;
+	lensl->pwm1_value = lensl->pwm1_committed;
+	if (lensl->pwm1_value > -1)
+		lensl_event(LENSL_EVENT_FAN_PWM, 0, lensl->pwm1_value);
+}
+
+static void fan_write_worker(struct work_struct *work)
+{
+	int res, mode;
+
+	lensl_cost_wakeup(LENSL_WAKE_FAN_WRITE);
+	mutex_lock(&lensl->fan_mutex);
+	if (!lensl->fan_write_pending)
+		goto out;
+	lensl->fan_write_pending = 0;
+	/* SFNV with action 1 would force manual mode back on if the
+	   firmware went back to automatic since fan_mode_seen was set */
+	mode = pwm1_enable_get_current();
+	if (mode == 0) {
+		vdbg_printk(LENSL_DEBUG,
+			"Fan is in automatic mode, dropping duty %d\n",
+			lensl->pwm1_value);
+		if (lensl->fan_mode_seen != 0) {
+			lensl->fan_mode_seen = 0;
+			lensl_event(LENSL_EVENT_FAN_MODE, 0, 0);
+		}
+		fan_write_rollback();
+		goto out;
+	}
+	res = mode < 0 ? mode : set_sfnv(1, lensl->pwm1_value);
+	if (res) {
+		lensl->fan_stats.errors++;
+		vdbg_printk(LENSL_WARNING, "Failed to set fan duty %d\n",
+			lensl->pwm1_value);
+		fan_write_rollback();
+	} else {
+		lensl->fan_stats.commits++;
+		lensl->pwm1_committed = lensl->pwm1_value;
+	}
+out:
+	mutex_unlock(&lensl->fan_mutex);
+}
+
+/* speed must be in range 0 .. 255; in manual mode, the firmware gets the
+   new speed from fan_write_worker() */
+static int lensl_fan_set_pwm(int speed)
+{
+	int status, cached, res = 0;
+
+	mutex_lock(&lensl->fan_mutex);
+	lensl->fan_stats.requests++;
+	if (speed < lensl->fan_pwm_floor)
+		speed = lensl->fan_pwm_floor;
+	status = lensl->fan_mode_seen;
+	cached = status >= 0;
+	if (!cached) {
+		status = pwm1_enable_get_current();
+		if (status < 0) {
+			res = status;
+			goto out;
+		}
+		lensl->fan_mode_seen = status;
+	}
+	/* a request that reaches the worker costs it one DECF read, so
+	   only those folded into a pending write, or taken in automatic
+	   mode, save one */
+	if (status > 0) {
+		if (lensl->fan_write_pending) {
+			lensl->fan_stats.sfnv_saved++;
+			if (cached)
+				lensl->fan_stats.decf_saved++;
+		} else {
+			lensl->fan_write_pending = 1;
+			queue_delayed_work(lensl_wq, &fan_write_work,
+				msecs_to_jiffies(max(fan_write_delay, 0)));
+		}
+	} else if (cached)
+		lensl->fan_stats.decf_saved++;
+
+	if (lensl->pwm1_value != speed) {
+		lensl->pwm1_value = speed;
+		lensl_event(LENSL_EVENT_FAN_PWM, 0, speed);
+	}
+out:
+	mutex_unlock(&lensl->fan_mutex);
+	return res;
+}
+
+/* status: 0 = automatic, 1 = manual; called with fan_mutex held */
+static int fan_set_mode(int status)
+{
+	int res, speed;
+
+	if (status && lensl->pwm1_value > -1)
+		speed = lensl->pwm1_value;
+	else
+		speed = DEFAULT_PWM1;
+
+	/* this call carries any pending duty; the worker, if it runs
+	   anyway, finds nothing to do */
+	if (lensl->fan_write_pending) {
+		lensl->fan_write_pending = 0;
+		lensl->fan_stats.sfnv_saved++;
+	}
+	res = set_sfnv(status, speed);
+
+	if (res)
+		return res;
+	lensl->pwm1_committed = speed;
+	if (lensl->pwm1_value != speed) {
+		lensl->pwm1_value = speed;
+		lensl_event(LENSL_EVENT_FAN_PWM, 0, speed);
+	}
+	if (lensl->fan_mode_seen != status) {
+		lensl->fan_mode_seen = status;
+		lensl_event(LENSL_EVENT_FAN_MODE, 0, status);
+	}
+	return 0;
+}
+
+static int lensl_fan_set_mode(int status)
+{
+	int res;
+
+	mutex_lock(&lensl->fan_mutex);
+	res = fan_set_mode(status);
+	mutex_unlock(&lensl->fan_mutex);
+	return res;
+}
+
+/* floor > 0: switch to manual mode running at least at that pwm value;
+   floor == 0: back to automatic mode */
+/* on failure, the floor and pwm1 are left as they were */
+static int lensl_fan_set_floor(int floor)
+{
+	int res, old_floor, old_pwm;
+
+	mutex_lock(&lensl->fan_mutex);
+	old_floor = lensl->fan_pwm_floor;
+	old_pwm = lensl->pwm1_value;
+	lensl->fan_pwm_floor = floor;
+	if (floor && lensl->pwm1_value < floor)
+		lensl->pwm1_value = floor;
+	res = fan_set_mode(!!floor);
+	if (res) {
+		lensl->fan_pwm_floor = old_floor;
+		lensl->pwm1_value = old_pwm;
+	} else if (lensl->pwm1_value != old_pwm)
+		lensl_event(LENSL_EVENT_FAN_PWM, 0, lensl->pwm1_value);
+	mutex_unlock(&lensl->fan_mutex);
+	return res;
+}
+
+static ssize_t pwm1_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	int res;
+	unsigned long speed;
+	if (parse_strtoul(buf, 255, &speed))
+		return -EINVAL;
+	res = lensl_fan_set_pwm(speed);
+	if (res)
+		return res;
+	return count;
+}
+
+static ssize_t pwm1_enable_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int status;
+	status = pwm1_enable_get_current();
+	if (status < 0)
+		return status;
+	return snprintf(buf, PAGE_SIZE, "%u\n", status);
+}
+
+static ssize_t pwm1_enable_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	int res;
+	unsigned long status;
+
+	if (parse_strtoul(buf, 1, &status))
+		return -EINVAL;
+	res = lensl_fan_set_mode(status);
+	if (res)
+		return res;
+	return count;
+}
+
+static struct device_attribute dev_attr_fan1_input =
+	__ATTR(fan1_input, S_IRUGO,
+		fan1_input_show, NULL);
+static struct device_attribute dev_attr_pwm1 =
+	__ATTR(pwm1, S_IWUSR | S_IRUGO,
+		pwm1_show, pwm1_store);
+static struct device_attribute dev_attr_pwm1_enable =
+	__ATTR(pwm1_enable, S_IWUSR | S_IRUGO,
+		pwm1_enable_show, pwm1_enable_store);
+static struct device_attribute dev_attr_update_interval =
+	__ATTR(update_interval, S_IWUSR | S_IRUGO,
+		update_interval_show, update_interval_store);
+static SENSOR_DEVICE_ATTR(fan1_min, S_IWUSR | S_IRUGO,
+		fan1_limit_show, fan1_limit_store, 0);
+static SENSOR_DEVICE_ATTR(fan1_max, S_IWUSR | S_IRUGO,
+		fan1_limit_show, fan1_limit_store, 1);
+static SENSOR_DEVICE_ATTR(fan1_min_alarm, S_IRUGO,
+		fan1_alarm_show, NULL, LENSL_FAN_ALARM_MIN);
+static SENSOR_DEVICE_ATTR(fan1_max_alarm, S_IRUGO,
+		fan1_alarm_show, NULL, LENSL_FAN_ALARM_MAX);
+
+static struct attribute *hwmon_attributes[] = {
+	&dev_attr_pwm1_enable.attr, &dev_attr_pwm1.attr,
+	&dev_attr_fan1_input.attr, &dev_attr_update_interval.attr,
+	&sensor_dev_attr_fan1_min.dev_attr.attr,
+	&sensor_dev_attr_fan1_max.dev_attr.attr,
+	&sensor_dev_attr_fan1_min_alarm.dev_attr.attr,
+	&sensor_dev_attr_fan1_max_alarm.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group hwmon_attr_group = {
+	.attrs = hwmon_attributes,
+};
+
+static void hwmon_exit(void)
+{
+	/* the works are queued from the attributes (and from the ioctl
+	   interface, which is already gone), so remove those first: a
+	   pwm1 or update_interval write could otherwise queue them again
+	   after they were cancelled */
+	if (lensl->hwmon_device)
+		sysfs_remove_group(&lensl->hwmon_device->kobj,
+				   &hwmon_attr_group);
+	cancel_delayed_work_sync(&fan_write_work);
+	if (!lensl->hwmon_device)
+		return;
+
+	fan_sample_interval = 0;
+	cancel_delayed_work_sync(&fan_sample_work);
+	hwmon_device_unregister(lensl->hwmon_device);
+	lensl->hwmon_device = NULL;
+	kfree(lensl->fan_ring);
+	lensl->fan_ring = NULL;
+	/* switch fans to automatic mode on module unload */
+	set_sfnv(0, DEFAULT_PWM1);
+}
+
+static int hwmon_init(void)
+{
+	int res;
+
+	lensl->pwm1_value = lensl->pwm1_committed = -1;
+	lensl->fan_mode_seen = lensl->fan_rpm_seen = -1;
+	lensl->fan1_alarms = 0;
+	lensl->fan_ring_head = lensl->fan_ring_count = lensl->fan_ring_seq = 0;
+	INIT_DELAYED_WORK(&fan_sample_work, fan_sample_worker);
+	lensl->fan_write_pending = 0;
+	memset(&lensl->fan_stats, 0, sizeof(lensl->fan_stats));
+	/* start from the real state rather than from "unknown" */
+	lensl->fan_mode_seen = pwm1_enable_get_current();
+	lensl->pwm1_value = lensl->pwm1_committed = fan_read_duty();
+	lensl->fan_ring = kcalloc(LENSL_FAN_RING_SIZE, sizeof(*lensl->fan_ring),
+			GFP_KERNEL);
+	if (!lensl->fan_ring) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to allocate memory for fan telemetry\n");
+		return -ENOMEM;
+	}
+
+	lensl->hwmon_device = hwmon_device_register(&lensl_pdev->dev);
+	if (!lensl->hwmon_device) {
+		vdbg_printk(LENSL_ERR, "Failed to register hwmon device\n");
+		goto err_free;
+	}
+
+	res = sysfs_create_group(&lensl->hwmon_device->kobj,
+				 &hwmon_attr_group);
+	if (res < 0) {
+		vdbg_printk(LENSL_ERR, "Failed to create hwmon sysfs group\n");
+		goto err_unregister;
+	}
+
+	if (fan_sample_interval > 0)
+		queue_delayed_work(lensl_wq, &fan_sample_work, 0);
+	vdbg_printk(LENSL_DEBUG, "Initialized hwmon subdriver\n");
+	return 0;
+
+err_unregister:
+	hwmon_device_unregister(lensl->hwmon_device);
+	lensl->hwmon_device = NULL;
+err_free:
+	kfree(lensl->fan_ring);
+	lensl->fan_ring = NULL;
+	return -ENODEV;
+}
+
+/*************************************************************************
+    accelerometer
+ *************************************************************************/
+
+/* The EC exposes the HDAPS-style two-axis accelerometer as four
+   registers, which are read in one burst per sample. The driver samples
+   them from its own delayed work, as hdaps does from a timer, whether or
+   not anything has the input device open. The work has a workqueue of
+   its own and reads in the interactive class, so neither the other
+   works nor a throttled telemetry class delay a shock report. Samples
+   feed the input device (ABS_X/ABS_Y) and the accel_position
+   attribute, and a shock detector
+   that raises LENSL_EVENT_ACCEL_SHOCK from the sampling work itself as
+   soon as two consecutive samples differ by accel_shock or more, so that
+   disk protection does not wait for a userspace poll. The register
+   location varies and is given with accel_reg; a capture with the axis
+   registers can be replayed for testing like any other EC traffic. */
+
+#if LENSL_CONFIG_ACCEL
+
+#define LENSL_ACCEL_NAME "Lenovo ThinkPad SL accelerometer"
+
+static struct workqueue_struct *accel_wq;
+
+static void accel_queue(unsigned long delay)
+{
+	if (ACCESS_ONCE(lensl->accel_running))
+		queue_delayed_work(accel_wq, &lensl->accel_work, delay);
+}
+
+static void accel_worker(struct work_struct *work)
+{
+	int x, y, delta = 0, shock;
+	u8 regs[4];
+
+	lensl_cost_wakeup(LENSL_WAKE_ACCEL);
+	accel_queue(msecs_to_jiffies(max(1000 / accel_rate, 1)));
+	if (lensl_ec_read_block(LENSL_EC_INTERACTIVE, accel_reg, regs,
+				sizeof(regs))) {
+		spin_lock(&lensl->accel.lock);
+		lensl->accel.errors++;
+		spin_unlock(&lensl->accel.lock);
+		return;
+	}
+	x = (s16)(regs[0] | regs[1] << 8);
+	y = (s16)(regs[2] | regs[3] << 8);
+
+	spin_lock(&lensl->accel.lock);
+	if (lensl->accel.valid)
+		delta = abs(x - lensl->accel.x) + abs(y - lensl->accel.y);
+	shock = accel_shock > 0 && delta >= accel_shock;
+	lensl->accel.x = x;
+	lensl->accel.y = y;
+	lensl->accel.valid = 1;
+	lensl->accel.samples++;
+	if (shock)
+		lensl->accel.shocks++;
+	spin_unlock(&lensl->accel.lock);
+
+	if (shock)
+		lensl_event(LENSL_EVENT_ACCEL_SHOCK, 0, delta);
+	input_report_abs(lensl->accel_inputdev, ABS_X, x);
+	input_report_abs(lensl->accel_inputdev, ABS_Y, y);
+	input_sync(lensl->accel_inputdev);
+}
+
+static void lensl_accel_notify(void)
+{
+	if (lensl->accel_inputdev)
+		sysfs_notify(&lensl_pdev->dev.kobj, NULL, "accel_shocks");
+}
+
+static ssize_t accel_position_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int x, y, valid;
+
+	spin_lock(&lensl->accel.lock);
+	x = lensl->accel.x;
+	y = lensl->accel.y;
+	valid = lensl->accel.valid;
+	spin_unlock(&lensl->accel.lock);
+	if (!valid)
+		return -ENODATA;
+	return sprintf(buf, "(%d,%d)\n", x, y);
+}
+
+static ssize_t accel_shocks_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", lensl->accel.shocks);
+}
+
+static ssize_t accel_stats_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	unsigned long samples, errors;
+
+	spin_lock(&lensl->accel.lock);
+	samples = lensl->accel.samples;
+	errors = lensl->accel.errors;
+	spin_unlock(&lensl->accel.lock);
+	return sprintf(buf, "samples: %lu\nerrors: %lu\n", samples, errors);
+}
+
+static ssize_t accel_rate_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", accel_rate);
+}
+
+/* the new interval is picked up by the next scheduled sample */
+static ssize_t accel_rate_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long rate;
+
+	if (parse_strtoul(buf, 1000, &rate) || !rate)
+		return -EINVAL;
+	accel_rate = rate;
+	return count;
+}
+
+static DEVICE_ATTR(accel_position, S_IRUGO, accel_position_show, NULL);
+static DEVICE_ATTR(accel_shocks, S_IRUGO, accel_shocks_show, NULL);
+static DEVICE_ATTR(accel_stats, S_IRUGO, accel_stats_show, NULL);
+static DEVICE_ATTR(accel_rate, S_IWUSR | S_IRUGO,
+		accel_rate_show, accel_rate_store);
+
+static struct attribute *accel_attributes[] = {
+	&dev_attr_accel_position.attr,
+	&dev_attr_accel_shocks.attr,
+	&dev_attr_accel_stats.attr,
+	&dev_attr_accel_rate.attr,
+	NULL
+};
+
+static const struct attribute_group accel_attr_group = {
+	.attrs = accel_attributes,
+};
+
+static void accel_exit(void)
+{
+	if (!lensl->accel_inputdev)
+		return;
+	lensl->accel_running = 0;
+	cancel_delayed_work_sync(&lensl->accel_work);
+	destroy_workqueue(accel_wq);
+	accel_wq = NULL;
+	sysfs_remove_group(&lensl_pdev->dev.kobj, &accel_attr_group);
+	input_unregister_device(lensl->accel_inputdev);
+	lensl->accel_inputdev = NULL;
+}
+
+static int accel_init(void)
+{
+	struct input_dev *idev;
+	int res;
+
+	if (accel_reg < 0)
+		return -ENODEV;
+	/* lensl_ec_read_block() needs reg + len <= 0xFF */
+	if (accel_reg > 0xFF - 4 || accel_rate <= 0 || accel_rate > 1000) {
+		vdbg_printk(LENSL_ERR, "Invalid accelerometer parameters\n");
+		return -EINVAL;
+	}
+
+	lensl->accel.valid = 0;
+	lensl->accel.samples = lensl->accel.errors = lensl->accel.shocks = 0;
+	INIT_DELAYED_WORK(&lensl->accel_work, accel_worker);
+	accel_wq = create_singlethread_workqueue(LENSL_ACCEL_WORKQUEUE_NAME);
+	if (!accel_wq) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to create accelerometer workqueue\n");
+		return -ENOMEM;
+	}
+	idev = input_allocate_device();
+	if (!idev) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to allocate accelerometer input device\n");
+		res = -ENOMEM;
+		goto err_wq;
+	}
+	idev->name = LENSL_ACCEL_NAME;
+	idev->phys = LENSL_HKEY_FILE "/input1";
+	idev->id.bustype = BUS_HOST;
+	idev->id.vendor = PCI_VENDOR_ID_LENOVO;
+	idev->dev.parent = &lensl_pdev->dev;
+	set_bit(EV_ABS, idev->evbit);
+	input_set_abs_params(idev, ABS_X, -32768, 32767, 4, 4);
+	input_set_abs_params(idev, ABS_Y, -32768, 32767, 4, 4);
+
+	res = input_register_device(idev);
+	if (res) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to register accelerometer input device\n");
+		input_free_device(idev);
+		goto err_wq;
+	}
+	lensl->accel_inputdev = idev;
+	res = sysfs_create_group(&lensl_pdev->dev.kobj, &accel_attr_group);
+	if (res) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to create accelerometer attributes\n");
+		input_unregister_device(lensl->accel_inputdev);
+		lensl->accel_inputdev = NULL;
+		goto err_wq;
+	}
+	lensl->accel_running = 1;
+	accel_queue(0);
+	vdbg_printk(LENSL_DEBUG, "Initialized accelerometer subdriver\n");
+	return 0;
+
+err_wq:
+	destroy_workqueue(accel_wq);
+	accel_wq = NULL;
+	return res;
+}
+
+#else /* LENSL_CONFIG_ACCEL */
+
+static void lensl_accel_notify(void)
+{
+}
+
+static void accel_exit(void)
+{
+}
+
+static int accel_init(void)
+{
+	return -ENODEV;
+}
+
+#endif /* LENSL_CONFIG_ACCEL */
+
+/*************************************************************************
+    battery
+ *************************************************************************/
+
+/* The ACPI battery driver gets the battery status from _BST, a method
+   that typically reads the same EC registers one at a time through the
+   AML interpreter, and competes with everything else for the EC while doing
+   so. Where the EC location of these registers is known (battery_reg),
+   the driver offers a power_supply that reads them in a single burst of
+   the telemetry class: a state byte (bit 0 discharging, bit 1 charging,
+   as in _BST) followed by rate, remaining charge and voltage. Readings
+   are cached for battery_max_age ms, so that a dashboard reading every
+   property of the supply costs one EC pass rather than one per
+   property. There is no polling: the EC is only read when a property is
+   read and the cache is stale. battery_latency in debugfs times both
+   paths side by side. */
+
+#if (defined(CONFIG_POWER_SUPPLY) || defined(CONFIG_POWER_SUPPLY_MODULE)) \
+	&& LENSL_CONFIG_BATTERY
+
+#define LENSL_BATTERY_NAME "lensl_battery"
+#define LENSL_BATTERY_REGS 7
+/* evaluations per path each time battery_latency is read */
+#define LENSL_BATTERY_PROBES 8
+
+static int battery_registered;
+static struct {
+	struct mutex lock;
+	unsigned long stamp;	/* jiffies of the last EC pass */
+	int valid;
+	int state, rate, remaining, voltage;
+	unsigned long hits, misses, errors;
+} battery = {
+	.lock = __MUTEX_INITIALIZER(battery.lock),
+};
+
+static int battery_read_ec(int *state, int *rate, int *remaining,
+			int *voltage)
+{
+	u8 regs[LENSL_BATTERY_REGS];
+	int res;
+
+	res = lensl_ec_read_block(LENSL_EC_TELEMETRY, battery_reg, regs,
+				sizeof(regs));
+	if (res)
+		return res;
+	*state = regs[0];
+	*rate = regs[1] | regs[2] << 8;
+	*remaining = regs[3] | regs[4] << 8;
+	*voltage = regs[5] | regs[6] << 8;
+	return 0;
+}
+
+/* called with battery.lock held; concurrent readers of a stale cache
+   wait for the one EC pass instead of each making their own */
+static int battery_refresh(void)
+{
+	int res;
+
+	if (battery.valid && battery_max_age > 0 &&
+	    time_before(jiffies,
+			battery.stamp + msecs_to_jiffies(battery_max_age))) {
+		battery.hits++;
+		return 0;
+	}
+	battery.misses++;
+	res = battery_read_ec(&battery.state, &battery.rate,
+			&battery.remaining, &battery.voltage);
+	if (res) {
+		battery.errors++;
+		battery.valid = 0;
+		return res;
+	}
+	battery.stamp = jiffies;
+	battery.valid = 1;
+	return 0;
+}
+
+static int battery_get_property(struct power_supply *psy,
+				enum power_supply_property psp,
+				union power_supply_propval *val)
+{
+	int res;
+
+	mutex_lock(&battery.lock);
+	res = battery_refresh();
+	if (res)
+		goto out;
+	switch (psp) {
+	case POWER_SUPPLY_PROP_STATUS:
+		if (battery.state & 0x01)
+			val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+		else if (battery.state & 0x02)
+			val->intval = POWER_SUPPLY_STATUS_CHARGING;
+		/* idle need not mean full (charge thresholds, a hot pack),
+		   and the full capacity is not among the registers read */
+		else
+			val->intval = POWER_SUPPLY_STATUS_NOT_CHARGING;
+		break;
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		val->intval = battery.voltage * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CURRENT_NOW:
+		val->intval = battery.rate * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		val->intval = battery.remaining * 1000;
+		break;
+	default:
+		res = -EINVAL;
+	}
+out:
+	mutex_unlock(&battery.lock);
+	return res;
+}
+
+static enum power_supply_property battery_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_VOLTAGE_NOW,
+	POWER_SUPPLY_PROP_CURRENT_NOW,
+	POWER_SUPPLY_PROP_CHARGE_NOW,
+};
+
+static struct power_supply battery_psy = {
+	.name		= LENSL_BATTERY_NAME,
+	.type		= POWER_SUPPLY_TYPE_BATTERY,
+	.properties	= battery_props,
+	.num_properties	= ARRAY_SIZE(battery_props),
+	.get_property	= battery_get_property,
+};
+
+static void battery_latency_line(struct seq_file *m, const char *name,
+		u64 total_ns, u64 max_ns, int n, int errors)
+{
+	seq_printf(m, "%s_mean_ns: %llu\n%s_max_ns: %llu\n%s_errors: %d\n",
+		name, (unsigned long long)div_u64(total_ns, n), name,
+		(unsigned long long)max_ns, name, errors);
+}
+
+/* Each read makes LENSL_BATTERY_PROBES uncached EC passes and as many
+   _BST evaluations, alternating so that both see the same EC load, and
+   reports the wall time of each path. _BST is not evaluated when
+   replaying or simulating, or when the firmware has no LENSL_BAT0. */
+static int battery_latency_show(struct seq_file *m, void *v)
+{
+	u64 ns, ec_total = 0, ec_max = 0, bst_total = 0, bst_max = 0;
+	int state, rate, remaining, voltage, bst[4];
+	int i, ec_errors = 0, bst_errors = 0;
+	struct lensl_acpi_result res;
+	ktime_t start;
+
+	for (i = 0; i < LENSL_BATTERY_PROBES; i++) {
+		start = ktime_get();
+		if (battery_read_ec(&state, &rate, &remaining, &voltage))
+			ec_errors++;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		ec_total += ns;
+		ec_max = max(ec_max, ns);
+		if (!lensl->bat0_handle)
+			continue;
+		res.type = LENSL_ACPI_PACKAGE;
+		res.data = bst;
+		res.size = ARRAY_SIZE(bst);
+		start = ktime_get();
+		if (lensl_acpi_typed_func(lensl->bat0_handle, "_BST", &res,
+					0, NULL))
+			bst_errors++;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		bst_total += ns;
+		bst_max = max(bst_max, ns);
+	}
+
+	seq_printf(m, "probes: %d\n", LENSL_BATTERY_PROBES);
+	battery_latency_line(m, "ec", ec_total, ec_max,
+			LENSL_BATTERY_PROBES, ec_errors);
+	if (lensl->bat0_handle)
+		battery_latency_line(m, "acpi_bst", bst_total, bst_max,
+				LENSL_BATTERY_PROBES, bst_errors);
+	else
+		seq_printf(m, "acpi_bst: n/a\n");
+	mutex_lock(&battery.lock);
+	seq_printf(m, "cache_hits: %lu\ncache_misses: %lu\nec_errors: %lu\n",
+		battery.hits, battery.misses, battery.errors);
+	mutex_unlock(&battery.lock);
+	return 0;
+}
+
+static int battery_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, battery_latency_show, NULL);
+}
+
+static const struct file_operations battery_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= battery_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void battery_debugfs_init(struct dentry *dir)
+{
+	if (battery_registered)
+		debugfs_create_file("battery_latency", S_IRUSR, dir, NULL,
+				&battery_latency_fops);
+}
+
+static void battery_exit(void)
+{
+	if (!battery_registered)
+		return;
+	power_supply_unregister(&battery_psy);
+	battery_registered = 0;
+	lensl->bat0_handle = NULL;
+}
+
+static int battery_init(void)
+{
+	int res;
+
+	if (battery_reg < 0)
+		return -ENODEV;
+	/* lensl_ec_read_block() needs reg + len <= 0xFF */
+	if (battery_reg > 0xFF - LENSL_BATTERY_REGS) {
+		vdbg_printk(LENSL_ERR, "Invalid battery_reg\n");
+		return -EINVAL;
+	}
+
+	battery.valid = 0;
+	battery.hits = battery.misses = battery.errors = 0;
+	if (lensl_fw_virtual() ||
+	    ACPI_FAILURE(acpi_get_handle(NULL, LENSL_BAT0,
+					 &lensl->bat0_handle)))
+		lensl->bat0_handle = NULL;
+	res = power_supply_register(&lensl_pdev->dev, &battery_psy);
+	if (res) {
+		vdbg_printk(LENSL_ERR, "Failed to register battery\n");
+		lensl->bat0_handle = NULL;
+		return res;
+	}
+	battery_registered = 1;
+	vdbg_printk(LENSL_DEBUG, "Initialized battery subdriver\n");
+	return 0;
+}
+
+#else /* CONFIG_POWER_SUPPLY && LENSL_CONFIG_BATTERY */
+
+static void battery_debugfs_init(struct dentry *dir)
+{
+}
+
+static void battery_exit(void)
+{
+}
+
+static int battery_init(void)
+{
+	return -ENODEV;
+}
+
+#endif /* CONFIG_POWER_SUPPLY && LENSL_CONFIG_BATTERY */
+
+/*************************************************************************
+    hotkeys
+ *************************************************************************/
+
+/* Hotkey pipeline statistics, see debugfs hotkey_stats. Scancodes come
+   from the EC ring (polled) or from debugfs hotkey_inject (injected);
+   each is either delivered as an input event or swallowed (bound to an
+   action with noreport, or mapped to KEY_RESERVED). Dispatch times are
+   kept as a histogram in powers of two microseconds. */
+#define LENSL_HKEY_HIST 12
+
+static struct {
+	spinlock_t lock;
+	unsigned long polled, injected, delivered, swallowed;
+	u64 ns, max_ns;
+	unsigned long hist[LENSL_HKEY_HIST];
+	/* EC errors seen by the poller, per LENSL_HKEY_ERR_* */
+	unsigned long errors[2], recoveries;
+	/* consistent ring reads, see hkey_ec_read_ring() */
+	unsigned long ring_tears, ring_retries, ring_deferred;
+} hkey_stats = {
+	.lock = __SPIN_LOCK_UNLOCKED(hkey_stats.lock),
+};
+
+/* serializes hkey_dispatch() between the poll thread and injection */
+static DEFINE_MUTEX(hkey_dispatch_mutex);
+
+/* While the EC keeps failing (busy, firmware glitch, right after
+   resume), the poller backs off exponentially, up to
+   LENSL_HKEY_MAX_BACKOFF doublings of its interval, and logs at a
+   limited rate; the first good read restores the normal rate and
+   reports LENSL_EVENT_HKEY_HEALTH. */
+enum {
+	LENSL_HKEY_ERR_OFFSET,		/* reading the ring offset */
+	LENSL_HKEY_ERR_RING,		/* reading the ring */
+};
+
+#define LENSL_HKEY_MAX_BACKOFF 5
+
+struct key_entry {
+	char type;
+	u8 scancode;
+	int keycode;
+};
+
+enum { KE_KEY, KE_END };
+
+static struct key_entry ec_keymap[] = {
+	/* Fn F2 */
+	{KE_KEY, 0x0B, KEY_COFFEE },
+	/* Fn F3 */
+	{KE_KEY, 0x0C, KEY_BATTERY },
+	/* Fn F4; dispatches an ACPI event */
+	{KE_KEY, 0x0D, /* KEY_SLEEP */ KEY_RESERVED },
+	/* Fn F5; FIXME: should this be KEY_BLUETOOTH? */
+	{KE_KEY, 0x0E, KEY_WLAN },
+	/* Fn F7; dispatches an ACPI event */
+	{KE_KEY, 0x10, /* KEY_SWITCHVIDEOMODE */ KEY_RESERVED },
+	/* Fn F8 - ultranav; FIXME: find some keycode that fits this properly */
+	{KE_KEY, 0x11, KEY_PROG1 },
+	/* Fn F9 */
+	{KE_KEY, 0x12, KEY_EJECTCD },
+	/* Fn F12 */
+	{KE_KEY, 0x15, KEY_SUSPEND },
+	{KE_KEY, 0x69, KEY_VOLUMEUP },
+	{KE_KEY, 0x6A, KEY_VOLUMEDOWN },
+	{KE_KEY, 0x6B, KEY_MUTE },
+	/* Fn Home; dispatches an ACPI event */
+	{KE_KEY, 0x6C, KEY_BRIGHTNESSDOWN /*KEY_RESERVED*/ },
+	/* Fn End; dispatches an ACPI event */
+	{KE_KEY, 0x6D, KEY_BRIGHTNESSUP /*KEY_RESERVED*/ },
+	/* Fn spacebar - zoom */
+	{KE_KEY, 0x71, KEY_ZOOM },
+	/* Lenovo Care key */
+	{KE_KEY, 0x80, KEY_VENDOR },
+	{KE_END, 0},
+};
+
+static int ec_scancode_to_keycode(u8 scancode)
+{
+	struct key_entry *key;
+
+	for (key = ec_keymap; key->type != KE_END; key++)
+		if (scancode == key->scancode)
+			return key->keycode;
+
+	return -EINVAL;
+}
+
+static int hkey_inputdev_getkeycode(struct input_dev *dev, int scancode,
+					int *keycode)
+{
+	int result;
+
+	if (!dev)
+		return -EINVAL;
+
+	result = ec_scancode_to_keycode(scancode);
+	if (result >= 0) {
+		*keycode = result;
+		return 0;
+	}
+	return result;
+}
+
+static int hkey_inputdev_setkeycode(struct input_dev *dev, int scancode,
+					int keycode)
+{
+	struct key_entry *key;
+
+	if (!dev)
+		return -EINVAL;
+
+	for (key = ec_keymap; key->type != KE_END; key++)
+		if (scancode == key->scancode) {
+			clear_bit(key->keycode, dev->keybit);
+			key->keycode = keycode;
+			set_bit(key->keycode, dev->keybit);
+			return 0;
+		}
+
+	return -EINVAL;
+}
+
+static int hkey_ec_decode_offset(u8 offset)
+{
+	/* Hotkey events are stored in EC registers 0x0A .. 0x11
+	 * Address of last event is stored in EC registers 0x12 and
+	 * 0x14; if address is 0x01, last event is in register 0x0A;
+	 * if address is 0x07, last event is in register 0x10;
+	 * if address is 0x00, last event is in register 0x11 */
+
+	if (!offset)
+		offset = 8;
+	offset -= 1;
+	if (offset > 7)
+		return -EINVAL;
+	return offset;
+}
+
+static int hkey_ec_get_offset(void)
+{
+	u8 offset;
+
+	if (lensl_ec_read(LENSL_EC_INTERACTIVE, 0x12, &offset))
+		return -EINVAL;
+	return hkey_ec_decode_offset(offset);
+}
+
+/* The ring and its offset cannot be read in one EC transaction, so the
+   EC may store a new event between the two reads and the ring would not
+   match the offset read before it. After reading the ring, both copies
+   of the offset (0x12 and 0x14, read in one burst with 0x13) are checked
+   again: they must agree with each other and with offset. If they do
+   not, the EC has moved on or is between updating them, and the ring is
+   read again for the newest offset, up to LENSL_HKEY_RING_TRIES times.
+   Returns the offset that the ring contents belong to, -EAGAIN if the
+   ring never settled (the events stay in the ring for the next tick) or
+   -EIO. */
+#define LENSL_HKEY_RING_TRIES 3
+
+static int hkey_ec_read_ring(int offset, u8 *ring, int len)
+{
+	int tries, now;
+	u8 check[3];
+
+	for (tries = 0; tries < LENSL_HKEY_RING_TRIES; tries++) {
+		if (lensl_ec_read_block(LENSL_EC_INTERACTIVE, 0x0A, ring,
+					len) ||
+		    lensl_ec_read_block(LENSL_EC_INTERACTIVE, 0x12, check,
+					sizeof(check)))
+			return -EIO;
+		now = hkey_ec_decode_offset(check[0]);
+		if (check[0] == check[2] && now == offset)
+			return offset;
+		spin_lock(&hkey_stats.lock);
+		hkey_stats.ring_tears++;
+		if (tries < LENSL_HKEY_RING_TRIES - 1)
+			hkey_stats.ring_retries++;
+		else
+			hkey_stats.ring_deferred++;
+		spin_unlock(&hkey_stats.lock);
+		if (check[0] == check[2] && now >= 0)
+			offset = now;
+	}
+	return -EAGAIN;
+}
+
+/* Hotkey bindings run a built-in action straight from the poll thread
+   instead of leaving the key to a userspace daemon. The table is indexed
+   by scancode; each byte is a LENSL_HKEY_* action, optionally with
+   LENSL_HKEY_NOREPORT to swallow the input event when the action
+   succeeds, in which case a failed action falls back to reporting the
+   key, or with LENSL_HKEY_ONSUCCESS to report the key only when the
+   action succeeds. */
+
+enum {
+	LENSL_HKEY_NONE,		/* just report the key */
+	LENSL_HKEY_EVENT,		/* only send LENSL_EVENT_HOTKEY */
+	LENSL_HKEY_BRIGHTNESS_DOWN,
+	LENSL_HKEY_BRIGHTNESS_UP,
+	LENSL_HKEY_RADIOS_OFF,		/* same order as LENSL_RADIOS_* */
+	LENSL_HKEY_RADIOS_ON,
+	LENSL_HKEY_RADIOS_TOGGLE,
+	LENSL_HKEY_RADIOS_CYCLE,
+	LENSL_HKEY_FAN_AUTO,
+	LENSL_HKEY_FAN_MANUAL,
+	LENSL_HKEY_LED_OFF,		/* same order as lensl_led_set() */
+	LENSL_HKEY_LED_ON,
+	LENSL_HKEY_LED_BLINK,
+	LENSL_HKEY_ACTIONS,
+	LENSL_HKEY_ONSUCCESS = 0x40,
+	LENSL_HKEY_NOREPORT = 0x80,
+	LENSL_HKEY_FLAGS = LENSL_HKEY_ONSUCCESS | LENSL_HKEY_NOREPORT,
+};
+
+static const char *hkey_action_names[LENSL_HKEY_ACTIONS] = {
+	"none", "event", "brightness_down", "brightness_up",
+	"radios_off", "radios_on", "radios_toggle", "radios_cycle",
+	"fan_auto", "fan_manual", "led_off", "led_on", "led_blink",
+};
+
+/* brightness keys are handled here and not via an ACPI notifier in
+   order to prevent possible conflicts with video.c; they are reported
+   when the driver changed the brightness, and swallowed when it does not
+   control the backlight, so that they do not duplicate video.c's */
+static u8 hkey_bindings[256] = {
+	[0x6C] = LENSL_HKEY_BRIGHTNESS_DOWN | LENSL_HKEY_ONSUCCESS,
+	[0x6D] = LENSL_HKEY_BRIGHTNESS_UP | LENSL_HKEY_ONSUCCESS,
+};
+
+static int hkey_run_action(int action)
+{
+	switch (action) {
+	case LENSL_HKEY_BRIGHTNESS_DOWN:
+		return lensl_bd_step(-1);
+	case LENSL_HKEY_BRIGHTNESS_UP:
+		return lensl_bd_step(1);
+	case LENSL_HKEY_RADIOS_OFF:
+	case LENSL_HKEY_RADIOS_ON:
+	case LENSL_HKEY_RADIOS_TOGGLE:
+	case LENSL_HKEY_RADIOS_CYCLE:
+		if (!lensl_radios_present())
+			return -ENODEV;
+		return lensl_radios_apply(action - LENSL_HKEY_RADIOS_OFF);
+	case LENSL_HKEY_FAN_AUTO:
+	case LENSL_HKEY_FAN_MANUAL:
+		if (!lensl->hwmon_device)
+			return -ENODEV;
+		return lensl_fan_set_mode(action - LENSL_HKEY_FAN_AUTO);
+	case LENSL_HKEY_LED_OFF:
+	case LENSL_HKEY_LED_ON:
+	case LENSL_HKEY_LED_BLINK:
+		return lensl_led_set(action - LENSL_HKEY_LED_OFF);
+	}
+	return 0;
+}
+
+static void hkey_account(int delivered, ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int bucket = min(fls64(div_u64(ns, 1000)), LENSL_HKEY_HIST - 1);
+
+	lensl_perf_count(delivered ? LENSL_PERF_HOTKEYS_DELIVERED :
+			LENSL_PERF_HOTKEYS_SWALLOWED, 1);
+	spin_lock(&hkey_stats.lock);
+	if (delivered)
+		hkey_stats.delivered++;
+	else
+		hkey_stats.swallowed++;
+	hkey_stats.ns += ns;
+	if (ns > hkey_stats.max_ns)
+		hkey_stats.max_ns = ns;
+	hkey_stats.hist[bucket]++;
+	spin_unlock(&hkey_stats.lock);
+}
+
+/* decode and dispatch one scancode read from the EC hotkey ring */
+static void hkey_dispatch(u8 scancode)
+{
+	int keycode, binding, action, res;
+	ktime_t start = ktime_get();
+
+	mutex_lock(&hkey_dispatch_mutex);
+	keycode = ec_scancode_to_keycode(scancode);
+	if (keycode < 0)
+		keycode = KEY_RESERVED;
+	vdbg_printk(LENSL_DEBUG,
+	   "Got hotkey keycode %d (scancode %d)\n", keycode, scancode);
+	/* report unmapped and KEY_RESERVED scancodes too */
+	lensl_event(LENSL_EVENT_HOTKEY, scancode, keycode);
+
+	binding = hkey_bindings[scancode];
+	action = binding & ~LENSL_HKEY_FLAGS;
+	res = hkey_run_action(action);
+	if (action != LENSL_HKEY_NONE)
+		vdbg_printk(LENSL_DEBUG, "Hotkey action %s: %d\n",
+			hkey_action_names[action], res);
+	if (action == LENSL_HKEY_EVENT ||
+	    (!res && (binding & LENSL_HKEY_NOREPORT)) ||
+	    (res && (binding & LENSL_HKEY_ONSUCCESS)))
+		keycode = KEY_RESERVED;
+
+	if (keycode != KEY_RESERVED) {
+		input_report_key(lensl->hkey_inputdev, keycode, 1);
+		input_sync(lensl->hkey_inputdev);
+		input_report_key(lensl->hkey_inputdev, keycode, 0);
+		input_sync(lensl->hkey_inputdev);
+	}
+	mutex_unlock(&hkey_dispatch_mutex);
+	hkey_account(keycode != KEY_RESERVED, start);
+}
+
+/* the poller backs off while the EC keeps failing, so a few warnings
+   per minute are plenty; the state is ours, not the kernel's */
+static DEFINE_RATELIMIT_STATE(hkey_error_ratelimit, 60 * HZ, 5);
+
+static void hkey_poll_error(int err)
+{
+	static const char *what[] = { "register offset", "code" };
+
+	spin_lock(&hkey_stats.lock);
+	hkey_stats.errors[err]++;
+	spin_unlock(&hkey_stats.lock);
+	if (lensl->hkey_backoff < LENSL_HKEY_MAX_BACKOFF) {
+		if (!lensl->hkey_backoff)
+			lensl_event(LENSL_EVENT_HKEY_HEALTH, 0, 0);
+		lensl->hkey_backoff++;
+	}
+	if (lensl_dbg_level_on(LENSL_WARNING) &&
+	    __ratelimit(&hkey_error_ratelimit))
+		vdbg_printk(LENSL_WARNING,
+			"Failed to read hotkey %s from EC, polling every "
+			"%d ms\n", what[err],
+			(1000 / lensl->hkey_poll_hz) << lensl->hkey_backoff);
+}
+
+static void hkey_poll_ok(void)
+{
+	if (!lensl->hkey_backoff)
+		return;
+	lensl->hkey_backoff = 0;
+	spin_lock(&hkey_stats.lock);
+	hkey_stats.recoveries++;
+	spin_unlock(&hkey_stats.lock);
+	vdbg_printk(LENSL_INFO, "Hotkey polling recovered\n");
+	lensl_event(LENSL_EVENT_HKEY_HEALTH, 0, 1);
+}
+
+static int hkey_poll_kthread(void *data)
+{
+	unsigned long t = 0;
+	int offset, synced = 0;
+	u8 ring[8];
+
+	mutex_lock(&lensl->hkey_poll_mutex);
+
+	/* events already in the ring at start are not ours to report; if
+	   the offset cannot be read yet, the first good read sets it */
+	lensl->hkey_backoff = 0;
+	offset = hkey_ec_get_offset();
+	if (offset < 0)
+		hkey_poll_error(LENSL_HKEY_ERR_OFFSET);
+	else {
+		lensl->hkey_ec_prev_offset = offset;
+		synced = 1;
+	}
+
+	while (!kthread_should_stop() && lensl->hkey_poll_hz) {
+		if (t == 0)
+			t = (1000 / lensl->hkey_poll_hz) << lensl->hkey_backoff;
+		t = msleep_interruptible(t);
+		if (unlikely(kthread_should_stop()))
+			break;
+		lensl_cost_wakeup(LENSL_WAKE_HKEY_POLL);
+		try_to_freeze();
+		if (t > 0)
+			continue;
+		offset = hkey_ec_get_offset();
+		if (offset < 0) {
+			hkey_poll_error(LENSL_HKEY_ERR_OFFSET);
+			continue;
+		}
+		if (!synced) {
+			lensl->hkey_ec_prev_offset = offset;
+			synced = 1;
+			hkey_poll_ok();
+			continue;
+		}
+		if (offset == lensl->hkey_ec_prev_offset) {
+			hkey_poll_ok();
+			continue;
+		}
+
+		/* read the whole ring in one burst and drain every event
+		   queued since the last tick, not just the newest one */
+		offset = hkey_ec_read_ring(offset, ring, sizeof(ring));
+		if (offset == -EAGAIN)
+			continue;
+		if (offset < 0) {
+			hkey_poll_error(LENSL_HKEY_ERR_RING);
+			continue;
+		}
+		hkey_poll_ok();
+		do {
+			lensl->hkey_ec_prev_offset =
+				(lensl->hkey_ec_prev_offset + 1) % sizeof(ring);
+			spin_lock(&hkey_stats.lock);
+			hkey_stats.polled++;
+			spin_unlock(&hkey_stats.lock);
+			hkey_dispatch(ring[lensl->hkey_ec_prev_offset]);
+		} while (lensl->hkey_ec_prev_offset != offset);
+	}
+
+	mutex_unlock(&lensl->hkey_poll_mutex);
+	return 0;
+}
+
+static void hkey_poll_start(void)
+{
+	lensl->hkey_ec_prev_offset = 0;
+	mutex_lock(&lensl->hkey_poll_mutex);
+	lensl->hkey_poll_task = kthread_run(hkey_poll_kthread,
+		NULL, LENSL_HKEY_POLL_KTHREAD_NAME);
+	if (IS_ERR(lensl->hkey_poll_task)) {
+		lensl->hkey_poll_task = NULL;
+		vdbg_printk(LENSL_ERR,
+			"Could not create kernel thread for hotkey polling\n");
+	}
+	mutex_unlock(&lensl->hkey_poll_mutex);
+}
+
+static void hkey_poll_stop(void)
+{
+	if (lensl->hkey_poll_task) {
+		if (frozen(lensl->hkey_poll_task) ||
+		    freezing(lensl->hkey_poll_task))
+			thaw_process(lensl->hkey_poll_task);
+
+		kthread_stop(lensl->hkey_poll_task);
+		lensl->hkey_poll_task = NULL;
+		mutex_lock(&lensl->hkey_poll_mutex);
+		/* at this point, the thread did exit */
+		mutex_unlock(&lensl->hkey_poll_mutex);
+	}
+}
+
+static void hkey_inputdev_exit(void)
+{
+	if (lensl->hkey_inputdev)
+		input_unregister_device(lensl->hkey_inputdev);
+	lensl->hkey_inputdev = NULL;
+}
+
+static int hkey_inputdev_init(void)
+{
+	int result;
+	struct key_entry *key;
+
+	lensl->hkey_inputdev = input_allocate_device();
+	if (!lensl->hkey_inputdev) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to allocate hotkey input device\n");
+		return -ENODEV;
+	}
+	lensl->hkey_inputdev->name = "Lenovo ThinkPad SL Series extra buttons";
+	lensl->hkey_inputdev->phys = LENSL_HKEY_FILE "/input0";
+	lensl->hkey_inputdev->uniq = LENSL_HKEY_FILE;
+	lensl->hkey_inputdev->id.bustype = BUS_HOST;
+	lensl->hkey_inputdev->id.vendor = PCI_VENDOR_ID_LENOVO;
+	lensl->hkey_inputdev->getkeycode = hkey_inputdev_getkeycode;
+	lensl->hkey_inputdev->setkeycode = hkey_inputdev_setkeycode;
+	set_bit(EV_KEY, lensl->hkey_inputdev->evbit);
+
+	for (key = ec_keymap; key->type != KE_END; key++)
+		set_bit(key->keycode, lensl->hkey_inputdev->keybit);
+
+	if (radio_hotkey)
+		hkey_bindings[0x0E] = LENSL_HKEY_RADIOS_TOGGLE |
+			LENSL_HKEY_NOREPORT;
+
+	result = input_register_device(lensl->hkey_inputdev);
+	if (result) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to register hotkey input device\n");
+		input_free_device(lensl->hkey_inputdev);
+		lensl->hkey_inputdev = NULL;
+		return -ENODEV;
+	}
+	vdbg_printk(LENSL_DEBUG, "Initialized hotkey subdriver\n");
+	return 0;
+}
+
+
+/*************************************************************************
+    platform profiles
+ *************************************************************************/
+
+/* Each profile is a policy built from the existing controls, so that the
+   whole thermal/performance posture can be switched with one write to
+   platform_profile. The names follow the kernel's platform_profile ABI. */
+
+struct lensl_profile {
+	const char *name;
+	int fan_floor;		/* pwm floor in manual mode, 0 = automatic */
+	int backlight_pct;	/* brightness cap, % of the top level */
+	int hkey_hz;		/* hotkey polling rate */
+};
+
+static const struct lensl_profile lensl_profiles[] = {
+	{ "low-power",	 0,	50,	2 },
+	{ "balanced",	 0,	100,	5 },
+	{ "performance", 160,	100,	10 },
+};
+
+static DEFINE_MUTEX(lensl_profile_mutex);
+
+static int lensl_profile_set(int profile)
+{
+	const struct lensl_profile *p = &lensl_profiles[profile];
+	int res = 0;
+
+	mutex_lock(&lensl_profile_mutex);
+	if (profile != lensl->profile) {
+		/* the fan is the only part that can fail; nothing has been
+		   changed if it does */
+		if (lensl->hwmon_device)
+			res = lensl_fan_set_floor(p->fan_floor);
+		if (res)
+			goto out;
+		lensl_bd_set_cap(p->backlight_pct);
+		lensl->hkey_poll_hz = p->hkey_hz;
+		lensl->profile = profile;
+		lensl_event(LENSL_EVENT_PROFILE, 0, profile);
+	}
+out:
+	mutex_unlock(&lensl_profile_mutex);
+	return res;
+}
+
+static ssize_t platform_profile_choices_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(lensl_profiles); i++)
+		len += sprintf(buf + len, "%s%s", i ? " " : "",
+			lensl_profiles[i].name);
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+
+static ssize_t platform_profile_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", lensl_profiles[lensl->profile].name);
+}
+
+static ssize_t platform_profile_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	int i, res;
+
+	for (i = 0; i < ARRAY_SIZE(lensl_profiles); i++)
+		if (sysfs_streq(buf, lensl_profiles[i].name))
+			break;
+	if (i == ARRAY_SIZE(lensl_profiles))
+		return -EINVAL;
+	res = lensl_profile_set(i);
+	if (res)
+		return res;
+	return count;
+}
+
+static DEVICE_ATTR(platform_profile_choices, S_IRUGO,
+		platform_profile_choices_show, NULL);
+static DEVICE_ATTR(platform_profile, S_IWUSR | S_IRUGO,
+		platform_profile_show, platform_profile_store);
+
+/*************************************************************************
+    platform device attributes
+ *************************************************************************/
+
+/* radios: write "on", "off" or "toggle" to switch all radios at once;
+   read back one line per radio with the state and result (0 or -errno)
+   of the last such operation */
+
+static ssize_t radios_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	int i, len = 0;
+
+	mutex_lock(&lensl_radio_mutex);
+	for (i = 0; i < LENSL_RADIO_COUNT; i++)
+		len += sprintf(buf + len, "%s %s %d\n", lensl->radios[i].name,
+			lensl->radios_last[i].on ? "on" : "off",
+			lensl->radios_last[i].result);
+	mutex_unlock(&lensl_radio_mutex);
+	return len;
+}
+
+static ssize_t radios_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	int op, res;
+
+	if (sysfs_streq(buf, "off"))
+		op = LENSL_RADIOS_OFF;
+	else if (sysfs_streq(buf, "on"))
+		op = LENSL_RADIOS_ON;
+	else if (sysfs_streq(buf, "toggle"))
+		op = LENSL_RADIOS_TOGGLE;
+	else
+		return -EINVAL;
+	if (!lensl_radios_present())
+		return -ENODEV;
+	res = lensl_radios_apply(op);
+	if (res)
+		return res;
+	return count;
+}
+
+static DEVICE_ATTR(radios, S_IWUSR | S_IRUGO, radios_show, radios_store);
+
+/* hotkey_bindings: one "<scancode> <action> report|noreport|onsuccess"
+   line per key of ec_keymap; write a line of the same form to change a
+   binding (the last word defaults to report) */
+
+/* indexed by the LENSL_HKEY_FLAGS of a binding, shifted down */
+static const char *hkey_report_names[] = {
+	"report", "onsuccess", "noreport",
+};
+
+static ssize_t hotkey_bindings_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct key_entry *key;
+	int binding, len = 0;
+
+	for (key = ec_keymap; key->type != KE_END; key++) {
+		binding = hkey_bindings[key->scancode];
+		len += sprintf(buf + len, "0x%02x %s %s\n", key->scancode,
+			hkey_action_names[binding & ~LENSL_HKEY_FLAGS],
+			hkey_report_names[(binding & LENSL_HKEY_FLAGS) >> 6]);
+	}
+	return len;
+}
+
+static ssize_t hotkey_bindings_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	char name[20], report[10] = "report";
+	int scancode, action, i;
+
+	if (sscanf(buf, "%i %19s %9s", &scancode, name, report) < 2)
+		return -EINVAL;
+	if (scancode < 0 || scancode > 0xff ||
+	    ec_scancode_to_keycode(scancode) < 0)
+		return -EINVAL;
+	for (action = 0; action < LENSL_HKEY_ACTIONS; action++)
+		if (!strcmp(name, hkey_action_names[action]))
+			break;
+	if (action == LENSL_HKEY_ACTIONS)
+		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(hkey_report_names); i++)
+		if (!strcmp(report, hkey_report_names[i]))
+			break;
+	if (i == ARRAY_SIZE(hkey_report_names))
+		return -EINVAL;
+	hkey_bindings[scancode] = action | i << 6;
+	return count;
+}
+
+static DEVICE_ATTR(hotkey_bindings, S_IWUSR | S_IRUGO,
+		hotkey_bindings_show, hotkey_bindings_store);
+
+static struct attribute *lensl_platform_attributes[] = {
+	&dev_attr_platform_profile_choices.attr,
+	&dev_attr_platform_profile.attr,
+	&dev_attr_radios.attr,
+	&dev_attr_hotkey_bindings.attr,
+	NULL
+};
+
+static const struct attribute_group lensl_platform_attr_group = {
+	.attrs = lensl_platform_attributes,
+};
+
+static int lensl_platform_attrs_created;
+
+static void lensl_platform_attrs_exit(void)
+{
+	if (lensl_platform_attrs_created) {
+		sysfs_remove_group(&lensl_pdev->dev.kobj,
+				   &lensl_platform_attr_group);
+		lensl_platform_attrs_created = 0;
+	}
+}
+
+static int lensl_platform_attrs_init(void)
+{
+	int res;
+
+	res = sysfs_create_group(&lensl_pdev->dev.kobj,
+				 &lensl_platform_attr_group);
+	if (res) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to create platform device attributes\n");
+		return res;
+	}
+	lensl_platform_attrs_created = 1;
+	return 0;
+}
+
+/*************************************************************************
+    character device
+ *************************************************************************/
+
+/* /dev/lenovo-sl gets and sets batches of controls in one ioctl and
+   provides a read-only status page that mirrors the state of every
+   control. The page is kept up to date from lensl_event(), so reading
+   it costs no firmware traffic. The fan speed, the hardware radio
+   switch and mode changes made by the firmware raise no event by
+   themselves; while the page is mapped, the watch checks them at least
+   every LENSL_STATUS_WATCH_MS even if watch_interval is 0. See
+   lenovo-sl-laptop.h. */
+
+#define LENSL_STATUS_WATCH_MS 1000
+
+static void lensl_watch_kick(void);
+
+/* lensl_status is set and cleared under lensl_status_lock, so that an
+   event producer still running at unload never writes to a freed page */
+static struct lensl_status *lensl_status;
+static DEFINE_SPINLOCK(lensl_status_lock);
+static DEFINE_MUTEX(lensl_ctl_mutex);
+static int lensl_dev_registered;
+
+static void lensl_status_set(int id, int value)
+{
+	unsigned long flags;
+
+	if (!ACCESS_ONCE(lensl_status))
+		return;
+	spin_lock_irqsave(&lensl_status_lock, flags);
+	if (lensl_status) {
+		lensl_status->seq++;
+		smp_wmb();
+		lensl_status->value[id] = value;
+		lensl_status->timestamp = ktime_to_ns(ktime_get());
+		smp_wmb();
+		lensl_status->seq++;
+	}
+	spin_unlock_irqrestore(&lensl_status_lock, flags);
+}
+
+static void lensl_status_event(int event, int index, int value)
+{
+	int id;
+
+	switch (event) {
+	case LENSL_EVENT_WLSW:
+		id = LENSL_CTL_WLSW;
+		break;
+	case LENSL_EVENT_RADIO:
+		id = LENSL_CTL_BLUETOOTH + index;
+		break;
+	case LENSL_EVENT_BACKLIGHT:
+		id = LENSL_CTL_BRIGHTNESS;
+		break;
+	case LENSL_EVENT_FAN_MODE:
+		id = LENSL_CTL_FAN_MODE;
+		break;
+	case LENSL_EVENT_FAN_PWM:
+		id = LENSL_CTL_FAN_PWM;
+		break;
+	case LENSL_EVENT_FAN_RPM:
+		id = LENSL_CTL_FAN_RPM;
+		break;
+	case LENSL_EVENT_LED:
+		id = LENSL_CTL_LED;
+		break;
+	default:
+		return;
+	}
+	lensl_status_set(id, value);
+}
+
+static int lensl_ctl_get(int id, int *value)
+{
+	int res, hw_blocked;
+
+	switch (id) {
+	case LENSL_CTL_FAN_MODE:
+		res = pwm1_enable_get_current();
+		if (res < 0)
+			return res;
+		*value = res;
+		return 0;
+	case LENSL_CTL_FAN_PWM:
+		*value = ACCESS_ONCE(lensl->pwm1_value);
+		return *value < 0 ? -ENODATA : 0;
+	case LENSL_CTL_FAN_RPM:
+		return get_tach(value, 0) ? -EIO : 0;
+	case LENSL_CTL_WLSW:
+		if (get_wlsw(value))
+			return -EIO;
+		*value = !!*value;
+		return 0;
+	case LENSL_CTL_BLUETOOTH:
+	case LENSL_CTL_WWAN:
+	case LENSL_CTL_UWB:
+		id -= LENSL_CTL_BLUETOOTH;
+		if (id >= LENSL_RADIO_COUNT)
+			return -ENODEV;
+		res = lensl_radio_get(&lensl->radios[id], &hw_blocked, value);
+		if (res)
+			return res;
+		*value = !!(*value & LENSL_RADIO_RADIOSSW);
+		return 0;
+	case LENSL_CTL_BRIGHTNESS:
+		return lensl_bd_get_level(value);
+	case LENSL_CTL_LED:
+		return lensl_led_get(value);
+	}
+	return -EINVAL;
+}
+
+static int lensl_ctl_set(int id, int value)
+{
+	int hw_blocked;
+
+	switch (id) {
+	case LENSL_CTL_FAN_MODE:
+		if (value < 0 || value > 1)
+			return -EINVAL;
+		return lensl_fan_set_mode(value);
+	case LENSL_CTL_FAN_PWM:
+		if (value < 0 || value > 255)
+			return -EINVAL;
+		return lensl_fan_set_pwm(value);
+	case LENSL_CTL_BLUETOOTH:
+	case LENSL_CTL_WWAN:
+	case LENSL_CTL_UWB:
+		id -= LENSL_CTL_BLUETOOTH;
+		if (id >= LENSL_RADIO_COUNT)
+			return -ENODEV;
+		return lensl_radio_set_on(&lensl->radios[id], &hw_blocked,
+				value != 0);
+	case LENSL_CTL_BRIGHTNESS:
+		return lensl_bd_set_level(value);
+	case LENSL_CTL_LED:
+		return lensl_led_set(value);
+	case LENSL_CTL_FAN_RPM:
+	case LENSL_CTL_WLSW:
+		return -EPERM;
+	}
+	return -EINVAL;
+}
+
+static long lensl_dev_ioctl(struct file *file, unsigned int cmd,
+				unsigned long arg)
+{
+	struct lensl_batch batch;
+	struct lensl_ctl *ctl;
+	int i;
+
+	if (cmd != LENSL_IOC_GET && cmd != LENSL_IOC_SET)
+		return -ENOTTY;
+	if (cmd == LENSL_IOC_SET && !(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count > LENSL_BATCH_MAX)
+		return -EINVAL;
+
+	mutex_lock(&lensl_ctl_mutex);
+	for (i = 0; i < batch.count; i++) {
+		ctl = &batch.ctl[i];
+		if (ctl->id >= LENSL_CTL_COUNT)
+			ctl->result = -EINVAL;
+		else if (cmd == LENSL_IOC_GET)
+			ctl->result = lensl_ctl_get(ctl->id, &ctl->value);
+		else
+			ctl->result = lensl_ctl_set(ctl->id, ctl->value);
+	}
+	mutex_unlock(&lensl_ctl_mutex);
+
+	if (copy_to_user((void __user *)arg, &batch, sizeof(batch)))
+		return -EFAULT;
+	return 0;
+}
+
+/* mappings of the status page; the mapping holds the file, and so the
+   module, so the page outlives all of them */
+static atomic_t lensl_status_maps = ATOMIC_INIT(0);
+
+static void lensl_dev_vm_open(struct vm_area_struct *vma)
+{
+	if (atomic_inc_return(&lensl_status_maps) == 1)
+		lensl_watch_kick();
+}
+
+static void lensl_dev_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&lensl_status_maps);
+}
+
+static const struct vm_operations_struct lensl_dev_vm_ops = {
+	.open	= lensl_dev_vm_open,
+	.close	= lensl_dev_vm_close,
+};
+
+static int lensl_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int res;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	res = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(lensl_status) >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+	if (res)
+		return res;
+	/* ->open is not called for the first mapping */
+	vma->vm_ops = &lensl_dev_vm_ops;
+	lensl_dev_vm_open(vma);
+	return 0;
+}
+
+static const struct file_operations lensl_dev_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nonseekable_open,
+	.unlocked_ioctl	= lensl_dev_ioctl,
+	.compat_ioctl	= lensl_dev_ioctl,
+	.mmap		= lensl_dev_mmap,
+};
+
+static struct miscdevice lensl_miscdev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= LENSL_DEV_NAME,
+	.fops	= &lensl_dev_fops,
+};
+
+static void lensl_dev_exit(void)
+{
+	struct lensl_status *status;
+	unsigned long flags;
+
+	if (lensl_dev_registered) {
+		misc_deregister(&lensl_miscdev);
+		lensl_dev_registered = 0;
+	}
+	spin_lock_irqsave(&lensl_status_lock, flags);
+	status = lensl_status;
+	lensl_status = NULL;
+	spin_unlock_irqrestore(&lensl_status_lock, flags);
+	if (status) {
+		ClearPageReserved(virt_to_page(status));
+		free_page((unsigned long)status);
+	}
+}
+
+static int lensl_dev_init(void)
+{
+	struct lensl_status *status;
+	int i, res, value;
+
+	status = (struct lensl_status *)get_zeroed_page(GFP_KERNEL);
+	if (!status) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to allocate memory for status page\n");
+		return -ENOMEM;
+	}
+	SetPageReserved(virt_to_page(status));
+	status->version = LENSL_STATUS_VERSION;
+	for (i = 0; i < LENSL_CTL_COUNT; i++)
+		status->value[i] = -1;
+	lensl_status = status;
+
+	/* one full sweep; from here on the page follows lensl_event() */
+	for (i = 0; i < LENSL_CTL_COUNT; i++)
+		if (!lensl_ctl_get(i, &value))
+			lensl_status_set(i, value);
+
+	res = misc_register(&lensl_miscdev);
+	if (res) {
+		vdbg_printk(LENSL_ERR, "Failed to register /dev/%s\n",
+			LENSL_DEV_NAME);
+		lensl_dev_exit();
+		return res;
+	}
+	lensl_dev_registered = 1;
+	vdbg_printk(LENSL_DEBUG, "Initialized character device\n");
+	return 0;
+}
+
+/*************************************************************************
+    change notification
+ *************************************************************************/
+
+#if LENSL_CONFIG_NETLINK
+
+/* generic netlink event channel, see lenovo-sl-laptop.h */
+
+static struct genl_family lensl_nl_family = {
+	.id = GENL_ID_GENERATE,
+	.name = LENSL_NL_FAMILY_NAME,
+	.version = LENSL_NL_VERSION,
+	.maxattr = LENSL_NL_A_MAX,
+};
+
+static struct genl_multicast_group lensl_nl_mcgrp = {
+	.name = LENSL_NL_MCGRP_NAME,
+};
+
+static int lensl_nl_registered;
+
+#define LENSL_NL_EVENT_SIZE \
+	(nla_total_size(sizeof(u32)) * 3 + nla_total_size(sizeof(u64)))
+
+static void lensl_nl_send(int event, int index, int value)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!lensl_nl_registered)
+		return;
+
+	skb = genlmsg_new(LENSL_NL_EVENT_SIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+	hdr = genlmsg_put(skb, 0, 0, &lensl_nl_family, 0, LENSL_NL_C_EVENT);
+	if (!hdr)
+		goto nla_put_failure;
+	NLA_PUT_U32(skb, LENSL_NL_A_EVENT, event);
+	NLA_PUT_U64(skb, LENSL_NL_A_TIMESTAMP, ktime_to_ns(ktime_get()));
+	NLA_PUT_U32(skb, LENSL_NL_A_INDEX, index);
+	NLA_PUT_U32(skb, LENSL_NL_A_VALUE, value);
+	genlmsg_end(skb, hdr);
+
+	/* -ESRCH just means that nobody is listening */
+	genlmsg_multicast(skb, 0, lensl_nl_mcgrp.id, GFP_KERNEL);
+	return;
+
+nla_put_failure:
+	nlmsg_free(skb);
+}
+
+static void lensl_nl_exit(void)
+{
+	if (lensl_nl_registered) {
+		lensl_nl_registered = 0;
+		genl_unregister_family(&lensl_nl_family);
+	}
+}
+
+static int lensl_nl_init(void)
+{
+	int res;
+
+	res = genl_register_family(&lensl_nl_family);
+	if (res) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to register generic netlink family\n");
+		return res;
+	}
+	res = genl_register_mc_group(&lensl_nl_family, &lensl_nl_mcgrp);
+	if (res) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to register generic netlink multicast group\n");
+		genl_unregister_family(&lensl_nl_family);
+		return res;
+	}
+	lensl_nl_registered = 1;
+	vdbg_printk(LENSL_DEBUG, "Initialized netlink event channel\n");
+	return 0;
+}
+
+#else /* LENSL_CONFIG_NETLINK */
+
+static void lensl_nl_send(int event, int index, int value)
+{
+}
+
+static void lensl_nl_exit(void)
+{
+}
+
+static int lensl_nl_init(void)
+{
+	return -ENODEV;
+}
+
+#endif /* LENSL_CONFIG_NETLINK */
+
+/* Called whenever the driver causes or observes a state change that
+   userspace may be waiting for. Wakes up poll()/select() on the affected
+   sysfs attributes, emits change uevents where appropriate and multicasts
+   the event on the netlink channel. */
+static void lensl_event(int event, int index, int value)
+{
+	vdbg_printk(LENSL_DEBUG, "Event %d (%d, %d)\n", event, index, value);
+
+	lensl_nl_send(event, index, value);
+	lensl_status_event(event, index, value);
+
+	switch (event) {
+	case LENSL_EVENT_WLSW:
+		lensl_radio_notify_wlsw(value);
+		break;
+	case LENSL_EVENT_BACKLIGHT:
+		lensl_perf_count(LENSL_PERF_BACKLIGHT_CHANGES, 1);
+		lensl_bd_notify(value);
+		break;
+	case LENSL_EVENT_FAN_MODE:
+		hwmon_notify("pwm1_enable", true);
+		break;
+	case LENSL_EVENT_FAN_PWM:
+		hwmon_notify("pwm1", false);
+		break;
+	case LENSL_EVENT_FAN_RPM:
+		hwmon_notify("fan1_input", false);
+		break;
+	case LENSL_EVENT_PROFILE:
+		if (lensl_platform_attrs_created)
+			sysfs_notify(&lensl_pdev->dev.kobj, NULL,
+				"platform_profile");
+		break;
+	case LENSL_EVENT_ACCEL_SHOCK:
+		lensl_accel_notify();
+		break;
+	}
+}
+
+/* Nothing tells us when the hardware radio switch is flipped or when the
+   firmware changes the fan mode on its own, so check at a low rate:
+   every watch_interval ms, or every LENSL_STATUS_WATCH_MS while the
+   status page is mapped. */
+static void lensl_watch_worker(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lensl_watch_work, lensl_watch_worker);
+
+static int lensl_watch_period(void)
+{
+	if (watch_interval > 0)
+		return watch_interval;
+	if (atomic_read(&lensl_status_maps))
+		return LENSL_STATUS_WATCH_MS;
+	return 0;
+}
+
+/* called when the status page gets its first mapping */
+static void lensl_watch_kick(void)
+{
+	if (watch_interval <= 0)
+		queue_delayed_work(lensl_wq, &lensl_watch_work, 0);
+}
+
+static void lensl_watch_worker(struct work_struct *work)
+{
+	int period;
+
+	int value;
+
+	lensl_cost_wakeup(LENSL_WAKE_WATCH);
+	if (lensl_radios_present() && !get_wlsw(&value)) {
+		value = !!value;
+		if (lensl->watch_wlsw >= 0 && value != lensl->watch_wlsw)
+			lensl_event(LENSL_EVENT_WLSW, 0, value);
+		lensl->watch_wlsw = value;
+	}
+
+	/* the fan sampler, when running, does this at its own rate */
+	if (lensl->hwmon_device && fan_sample_interval <= 0) {
+		if (get_tach(&value, 0))
+			value = -1;
+		lensl_fan_observe(pwm1_enable_get_current(), value);
+	}
+
+	period = lensl_watch_period();
+	if (period > 0)
+		queue_delayed_work(lensl_wq, &lensl_watch_work,
+				msecs_to_jiffies(period));
+}
+
+static void lensl_watch_start(void)
+{
+	lensl->watch_wlsw = -1;
+	if (watch_interval > 0)
+		queue_delayed_work(lensl_wq, &lensl_watch_work, 0);
+}
+
+static void lensl_watch_stop(void)
+{
+	cancel_delayed_work_sync(&lensl_watch_work);
+}
+
+/*************************************************************************
+    procfs debugging interface
+ *************************************************************************/
+
+#if LENSL_CONFIG_PROCFS
+
+#define LENSL_PROC_EC "ec0"
+#define LENSL_PROC_EC_WATCH "ec0_watch"
+#define LENSL_PROC_DIRNAME LENSL_MODULE_NAME
+
+static struct proc_dir_entry *proc_dir, *proc_ec_watch;
+/* ec0_watch reads in the debug class, which may sleep for its budget, so
+   it does not run on lensl_wq */
+static struct workqueue_struct *ec_watch_wq;
+
+int lensl_ec_read_procmem(char *buf, char **start, off_t offset,
+		int count, int *eof, void *data)
+{
+	int i, j, n, err, row_err, len = 0;
+	u8 row[16];
+	/* note: ec_read at i = 255 locks up my SL300 hard. -AR */
+	for (i = 0; i < 255; i += 16) {
+		n = min(16, 255 - i);
+		len += sprintf(buf+len, "%02X:", i);
+		/* one burst per row; if that fails, redo the row byte by
+		   byte so that only the unreadable registers are marked.
+		   Other users of the EC get their turn between rows. */
+		row_err = lensl_ec_read_block(LENSL_EC_DEBUG, i, row, n);
+		for (j = 0; j < n; j++) {
+			err = row_err ? lensl_ec_read(LENSL_EC_DEBUG,
+						i + j, &row[j]) : 0;
+			if (!err)
+				len += sprintf(buf+len, " %02X", row[j]);
+			else
+				len += sprintf(buf+len, " **");
+		}
+		len += sprintf(buf+len, "\n");
+		cond_resched();
+	}
+	*eof = 1;
+	return len;
+}
+
+/* we expect input in the format "%02X %02X", where the first number is
+   the EC register and the second is the value to be written */
+int lensl_ec_write_procmem(struct file *file, const char *buffer,
+				unsigned long count, void *data)
+{
+	char s[7];
+	unsigned int reg, val;
+
+	if (count > 6)
+		return -EINVAL;
+	memset(s, 0, 7);
+	if (copy_from_user(s, buffer, count))
+		return -EFAULT;
+	if (sscanf(s, "%02X %02X", &reg, &val) < 2)
+		return -EINVAL;
+	if (reg > 255 || val > 255)
+		return -EINVAL;
+	if (lensl_ec_write(LENSL_EC_DEBUG, reg, val))
+		return -EIO;
+	return count;
+}
+
+/* EC change watch: instead of diffing full ec0 dumps, write
+   "<interval in ms> <reg> <reg> ..." (registers in hex) to ec0_watch to
+   have only those registers sampled in the kernel, then read or poll
+   ec0_watch for lines of the form "<timestamp in ns> <reg> <old> <new>".
+   If the reader falls behind, the oldest changes are dropped and a
+   "lost <n>" line is emitted in their place. Writing "0" stops it. */
+
+#define LENSL_EC_WATCH_RING 256
+
+struct lensl_ec_change {
+	u64 timestamp;
+	u8 reg, old, new;
+};
+
+static struct {
+	DECLARE_BITMAP(regs, 255);
+	DECLARE_BITMAP(valid, 255);
+	u8 values[255];
+	int interval;
+	struct delayed_work work;
+	struct mutex config_mutex;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct lensl_ec_change ring[LENSL_EC_WATCH_RING];
+	unsigned int head, count, lost;
+} ec_watch;
+
+static void ec_watch_push(struct lensl_ec_change *c)
+{
+	spin_lock(&ec_watch.lock);
+	ec_watch.ring[(ec_watch.head + ec_watch.count) %
+		LENSL_EC_WATCH_RING] = *c;
+	if (ec_watch.count < LENSL_EC_WATCH_RING)
+		ec_watch.count++;
+	else {
+		ec_watch.head = (ec_watch.head + 1) % LENSL_EC_WATCH_RING;
+		ec_watch.lost++;
+	}
+	spin_unlock(&ec_watch.lock);
+}
+
+static void ec_watch_worker(struct work_struct *work)
+{
+	struct lensl_ec_change c;
+	int reg, end, i, changed = 0;
+	u8 run[255];
+
+	/* each run of adjacent watched registers is read in one burst */
+	for (reg = find_first_bit(ec_watch.regs, 255); reg < 255;
+			reg = find_next_bit(ec_watch.regs, 255, end)) {
+		end = find_next_zero_bit(ec_watch.regs, 255, reg);
+		if (lensl_ec_read_block(LENSL_EC_DEBUG, reg, run, end - reg))
+			continue;
+		for (i = reg; i < end; i++) {
+			if (test_bit(i, ec_watch.valid) &&
+					run[i - reg] != ec_watch.values[i]) {
+				c.timestamp = ktime_to_ns(ktime_get());
+				c.reg = i;
+				c.old = ec_watch.values[i];
+				c.new = run[i - reg];
+				ec_watch_push(&c);
+				changed = 1;
+			}
+			ec_watch.values[i] = run[i - reg];
+			set_bit(i, ec_watch.valid);
+		}
+	}
+
+	if (changed)
+		wake_up_interruptible(&ec_watch.wait);
+	if (ec_watch.interval)
+		queue_delayed_work(ec_watch_wq, &ec_watch.work,
+				msecs_to_jiffies(ec_watch.interval));
+}
+
+static void ec_watch_stop(void)
+{
+	ec_watch.interval = 0;
+	cancel_delayed_work_sync(&ec_watch.work);
+}
+
+static ssize_t lensl_ec_watch_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct lensl_ec_change *c;
+	char line[48];
+	size_t done = 0;
+	int len, res;
+
+	while (done < count) {
+		spin_lock(&ec_watch.lock);
+		if (!ec_watch.count && !ec_watch.lost) {
+			spin_unlock(&ec_watch.lock);
+			if (done)
+				break;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			res = wait_event_interruptible(ec_watch.wait,
+					ec_watch.count || ec_watch.lost);
+			if (res)
+				return res;
+			continue;
+		}
+		if (ec_watch.lost)
+			len = sprintf(line, "lost %u\n", ec_watch.lost);
+		else {
+			c = &ec_watch.ring[ec_watch.head];
+			len = sprintf(line, "%llu %02X %02X %02X\n",
+				(unsigned long long)c->timestamp,
+				c->reg, c->old, c->new);
+		}
+		if (done + len > count) {
+			spin_unlock(&ec_watch.lock);
+			break;
+		}
+		if (ec_watch.lost)
+			ec_watch.lost = 0;
+		else {
+			ec_watch.head = (ec_watch.head + 1) %
+				LENSL_EC_WATCH_RING;
+			ec_watch.count--;
+		}
+		spin_unlock(&ec_watch.lock);
+
+		if (copy_to_user(buf + done, line, len))
+			return -EFAULT;
+		done += len;
+	}
+	return done ? done : -EINVAL;
+}
+
+static unsigned int lensl_ec_watch_poll(struct file *file,
+				struct poll_table_struct *wait)
+{
+	poll_wait(file, &ec_watch.wait, wait);
+	if (ec_watch.count || ec_watch.lost)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static ssize_t lensl_ec_watch_write(struct file *file,
+				const char __user *buffer,
+				size_t count, loff_t *ppos)
+{
+	char *s, *p, *tok;
+	unsigned long interval, reg;
+	int res = -EINVAL;
+
+	if (count > PAGE_SIZE)
+		return -EINVAL;
+	s = kzalloc(count + 1, GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+	if (copy_from_user(s, buffer, count)) {
+		kfree(s);
+		return -EFAULT;
+	}
+
+	mutex_lock(&ec_watch.config_mutex);
+	ec_watch_stop();
+	bitmap_zero(ec_watch.regs, 255);
+	p = strstrip(s);
+	tok = strsep(&p, " \t\n");
+	if (!tok || strict_strtoul(tok, 10, &interval) || interval > 60000)
+		goto out;
+	while ((tok = strsep(&p, " \t\n"))) {
+		if (!*tok)
+			continue;
+		/* see lensl_ec_read_procmem about register 0xFF */
+		if (strict_strtoul(tok, 16, &reg) || reg >= 255)
+			goto out;
+		set_bit(reg, ec_watch.regs);
+	}
+	res = count;
+	if (!interval || bitmap_empty(ec_watch.regs, 255))
+		goto out;
+
+	spin_lock(&ec_watch.lock);
+	ec_watch.head = ec_watch.count = ec_watch.lost = 0;
+	spin_unlock(&ec_watch.lock);
+	bitmap_zero(ec_watch.valid, 255);
+	ec_watch.interval = interval;
+	queue_delayed_work(ec_watch_wq, &ec_watch.work, 0);
+out:
+	mutex_unlock(&ec_watch.config_mutex);
+	kfree(s);
+	return res;
+}
+
+static const struct file_operations lensl_ec_watch_fops = {
+	.owner	= THIS_MODULE,
+	.read	= lensl_ec_watch_read,
+	.write	= lensl_ec_watch_write,
+	.poll	= lensl_ec_watch_poll,
+};
+
+static void lenovo_sl_procfs_exit(void)
+{
+	if (proc_ec_watch) {
+		remove_proc_entry(LENSL_PROC_EC_WATCH, proc_dir);
+		proc_ec_watch = NULL;
+		ec_watch_stop();
+		destroy_workqueue(ec_watch_wq);
+		ec_watch_wq = NULL;
+	}
+	if (proc_dir) {
+		remove_proc_entry(LENSL_PROC_EC, proc_dir);
+		remove_proc_entry(LENSL_PROC_DIRNAME, acpi_root_dir);
+		proc_dir = NULL;
+	}
+}
+
+static int lenovo_sl_procfs_init(void)
+{
+	struct proc_dir_entry *proc_ec;
+
+	proc_dir = proc_mkdir(LENSL_PROC_DIRNAME, acpi_root_dir);
+	if (!proc_dir) {
+		vdbg_printk(LENSL_ERR,
+		   "Failed to create proc dir acpi/%s/\n", LENSL_PROC_DIRNAME);
+		return -ENOENT;
+	}
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,29)
+	proc_dir->owner = THIS_MODULE;
+#endif
+	proc_ec = create_proc_entry(LENSL_PROC_EC, 0600, proc_dir);
+	if (!proc_ec) {
+		vdbg_printk(LENSL_ERR,
+			"Failed to create proc entry acpi/%s/%s\n",
+			LENSL_PROC_DIRNAME, LENSL_PROC_EC);
+		remove_proc_entry(LENSL_PROC_DIRNAME, acpi_root_dir);
+		proc_dir = NULL;
+		return -ENOENT;
+	}
+	proc_ec->read_proc = lensl_ec_read_procmem;
+	proc_ec->write_proc = lensl_ec_write_procmem;
+
+	memset(&ec_watch, 0, sizeof(ec_watch));
+	INIT_DELAYED_WORK(&ec_watch.work, ec_watch_worker);
+	mutex_init(&ec_watch.config_mutex);
+	spin_lock_init(&ec_watch.lock);
+	init_waitqueue_head(&ec_watch.wait);
+	ec_watch_wq = create_singlethread_workqueue(
+			LENSL_EC_WATCH_WORKQUEUE_NAME);
+	if (ec_watch_wq) {
+		proc_ec_watch = proc_create(LENSL_PROC_EC_WATCH, 0600,
+				proc_dir, &lensl_ec_watch_fops);
+		if (!proc_ec_watch) {
+			destroy_workqueue(ec_watch_wq);
+			ec_watch_wq = NULL;
+		}
+	}
+	if (!proc_ec_watch)
+		vdbg_printk(LENSL_WARNING,
+			"Failed to create proc entry acpi/%s/%s\n",
+			LENSL_PROC_DIRNAME, LENSL_PROC_EC_WATCH);
+	vdbg_printk(LENSL_DEBUG, "Initialized procfs debugging interface\n");
+
+	return 0;
 }
 
-static inline int get_decf(int *value)
+#else /* LENSL_CONFIG_PROCFS */
+
+static void lenovo_sl_procfs_exit(void)
 {
-	return lensl_acpi_int_func(ec0_handle, "DECF", value, 0);
 }
 
-/* speed must be in range 0 .. 255 */
-static inline int set_sfnv(int action, int speed)
+static int lenovo_sl_procfs_init(void)
 {
-	return lensl_acpi_int_func(ec0_handle, "SFNV", NULL, 2, action, speed);
+	return -ENODEV;
 }
 
-static int pwm1_enable_get_current(void)
+#endif /* LENSL_CONFIG_PROCFS */
+
+/*************************************************************************
+    debugfs statistics
+ *************************************************************************/
+
+static struct dentry *lensl_debugfs_dir;
+
+/* EC access cost per transport mode */
+static int lensl_ec_transport_show(struct seq_file *m, void *v)
 {
-	int res;
-	int value;
+	static const char *names[LENSL_EC_MODES] = { "byte", "burst" };
+	unsigned long calls[LENSL_EC_MODES], bytes[LENSL_EC_MODES], refused;
+	u64 ns[LENSL_EC_MODES];
+	unsigned long flags;
+	int i;
 
-	res = get_decf(&value);
-	if (res)
-		return res;
-	if (value & 1)
-		return 1;
+	spin_lock_irqsave(&lensl_ec_stats.lock, flags);
+	memcpy(calls, lensl_ec_stats.calls, sizeof(calls));
+	memcpy(bytes, lensl_ec_stats.bytes, sizeof(bytes));
+	memcpy(ns, lensl_ec_stats.ns, sizeof(ns));
+	refused = lensl_ec_stats.refused;
+	spin_unlock_irqrestore(&lensl_ec_stats.lock, flags);
+
+	seq_printf(m, "%-6s %10s %10s %14s %10s\n",
+		"mode", "calls", "bytes", "ns", "ns/byte");
+	for (i = 0; i < LENSL_EC_MODES; i++)
+		seq_printf(m, "%-6s %10lu %10lu %14llu %10llu\n", names[i],
+			calls[i], bytes[i], (unsigned long long)ns[i],
+			bytes[i] ? (unsigned long long)
+				div64_u64(ns[i], bytes[i]) : 0ULL);
+	seq_printf(m, "burst refused: %lu\n", refused);
 	return 0;
 }
 
-static ssize_t fan1_input_show(struct device *dev,
-				struct device_attribute *attr, char *buf)
+/* EC scheduler: transactions and time spent queued per class */
+static int lensl_ec_sched_show(struct seq_file *m, void *v)
 {
-	int res;
-	int rpm;
+	static const char *names[LENSL_EC_CLASSES] = {
+		"interactive", "telemetry", "debug" };
+	unsigned long transactions, throttled;
+	u64 queued, max_queued;
+	int i;
 
-	res = get_tach(&rpm, 0);
-	if (res)
-		return res;
-	return snprintf(buf, PAGE_SIZE, "%u\n", rpm);
+	seq_printf(m, "%-12s %8s %12s %10s %14s %12s\n", "class", "budget",
+		"transactions", "throttled", "queued_ns", "max_queued_ns");
+	for (i = 0; i < LENSL_EC_CLASSES; i++) {
+		spin_lock(&lensl_ec_sched.lock);
+		transactions = lensl_ec_sched.transactions[i];
+		throttled = lensl_ec_sched.throttled[i];
+		queued = lensl_ec_sched.queued_ns[i];
+		max_queued = lensl_ec_sched.max_queued_ns[i];
+		spin_unlock(&lensl_ec_sched.lock);
+		seq_printf(m, "%-12s %8d %12lu %10lu %14llu %12llu\n",
+			names[i], ec_budget[i], transactions, throttled,
+			(unsigned long long)queued,
+			(unsigned long long)max_queued);
+	}
+	return 0;
 }
 
-static ssize_t pwm1_show(struct device *dev,
-				struct device_attribute *attr, char *buf)
+static int lensl_ec_sched_open(struct inode *inode, struct file *file)
 {
-	if (pwm1_value > -1)
-		return snprintf(buf, PAGE_SIZE, "%u\n", pwm1_value);
-	return -EPERM;
+	return single_open(file, lensl_ec_sched_show, NULL);
 }
 
-static ssize_t pwm1_store(struct device *dev,
-				struct device_attribute *attr,
-				const char *buf, size_t count)
-{
-	int status, res = 0;
-	unsigned long speed;
-	if (parse_strtoul(buf, 255, &speed))
-		return -EINVAL;
-	status = pwm1_enable_get_current();
-	if (status < 0)
-		return status;
-	if (status > 0)
-		res = set_sfnv(1, speed);
-
-	if (res)
-		return res;
-	pwm1_value = speed;
-	return count;
-}
+static const struct file_operations lensl_ec_sched_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lensl_ec_sched_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-static ssize_t pwm1_enable_show(struct device *dev,
-				struct device_attribute *attr, char *buf)
+static int lensl_ec_transport_open(struct inode *inode, struct file *file)
 {
-	int status;
-	status = pwm1_enable_get_current();
-	if (status < 0)
-		return status;
-	return snprintf(buf, PAGE_SIZE, "%u\n", status);
+	return single_open(file, lensl_ec_transport_show, NULL);
 }
 
-static ssize_t pwm1_enable_store(struct device *dev,
-				struct device_attribute *attr,
-				const char *buf, size_t count)
-{
-	int res, speed;
-	unsigned long status;
-
-	if (parse_strtoul(buf, 1, &status))
-		return -EINVAL;
+static const struct file_operations lensl_ec_transport_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lensl_ec_transport_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	if (status && pwm1_value > -1)
-		speed = pwm1_value;
-	else
-		speed = DEFAULT_PWM1;
+#if LENSL_CONFIG_TRACE
 
-	res = set_sfnv(status, speed);
+/* drain recorded accesses as struct lensl_trace_rec; returns 0 when the
+   ring is empty */
+static ssize_t lensl_trace_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct lensl_trace_rec rec;
+	size_t done = 0;
 
-	if (res)
-		return res;
-	pwm1_value = speed;
-	return count;
+	if (count < sizeof(rec))
+		return -EINVAL;
+	while (done + sizeof(rec) <= count) {
+		spin_lock(&lensl_trace.lock);
+		if (lensl_trace.tail == lensl_trace.head) {
+			spin_unlock(&lensl_trace.lock);
+			break;
+		}
+		rec = lensl_trace.ring[lensl_trace.tail++ % lensl_trace.size];
+		spin_unlock(&lensl_trace.lock);
+		if (copy_to_user(buf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
+	}
+	return done;
 }
 
-static struct device_attribute dev_attr_fan1_input =
-	__ATTR(fan1_input, S_IRUGO,
-		fan1_input_show, NULL);
-static struct device_attribute dev_attr_pwm1 =
-	__ATTR(pwm1, S_IWUSR | S_IRUGO,
-		pwm1_show, pwm1_store);
-static struct device_attribute dev_attr_pwm1_enable =
-	__ATTR(pwm1_enable, S_IWUSR | S_IRUGO,
-		pwm1_enable_show, pwm1_enable_store);
-
-static struct attribute *hwmon_attributes[] = {
-	&dev_attr_pwm1_enable.attr, &dev_attr_pwm1.attr,
-	&dev_attr_fan1_input.attr,
-	NULL
-};
-
-static const struct attribute_group hwmon_attr_group = {
-	.attrs = hwmon_attributes,
+static const struct file_operations lensl_trace_fops = {
+	.owner		= THIS_MODULE,
+	.read		= lensl_trace_read,
 };
 
-static void hwmon_exit(void)
+/* recording and replay counters */
+static int lensl_trace_stats_show(struct seq_file *m, void *v)
 {
-	if (!lensl_hwmon_device)
-		return;
-
-	sysfs_remove_group(&lensl_hwmon_device->kobj,
-			   &hwmon_attr_group);
-	hwmon_device_unregister(lensl_hwmon_device);
-	lensl_hwmon_device = NULL;
-	/* switch fans to automatic mode on module unload */
-	set_sfnv(0, DEFAULT_PWM1);
+	spin_lock(&lensl_trace.lock);
+	seq_printf(m, "recorded: %lu\nlost: %lu\nqueued: %u\n",
+		lensl_trace.recorded, lensl_trace.lost,
+		lensl_trace.head - lensl_trace.tail);
+	seq_printf(m, "capture: %u\nreplayed: %lu\nmismatched: %lu\n"
+		"exhausted: %lu\n", lensl_trace.count, lensl_trace.replayed,
+		lensl_trace.mismatched, lensl_trace.exhausted);
+	spin_unlock(&lensl_trace.lock);
+	return 0;
 }
 
-static int hwmon_init(void)
+static int lensl_trace_stats_open(struct inode *inode, struct file *file)
 {
-	int res;
-
-	pwm1_value = -1;
-	lensl_hwmon_device = hwmon_device_register(&lensl_pdev->dev);
-	if (!lensl_hwmon_device) {
-		vdbg_printk(LENSL_ERR, "Failed to register hwmon device\n");
-		return -ENODEV;
-	}
-
-	res = sysfs_create_group(&lensl_hwmon_device->kobj,
-				 &hwmon_attr_group);
-	if (res < 0) {
-		vdbg_printk(LENSL_ERR, "Failed to create hwmon sysfs group\n");
-		hwmon_device_unregister(lensl_hwmon_device);
-		lensl_hwmon_device = NULL;
-		return -ENODEV;
-	}
-	vdbg_printk(LENSL_DEBUG, "Initialized hwmon subdriver\n");
-	return 0;
+	return single_open(file, lensl_trace_stats_show, NULL);
 }
 
-/*************************************************************************
-    hotkeys
- *************************************************************************/
-
-static int hkey_poll_hz = 5;
-static u8 hkey_ec_prev_offset;
-static struct mutex hkey_poll_mutex;
-static struct task_struct *hkey_poll_task;
-
-struct key_entry {
-	char type;
-	u8 scancode;
-	int keycode;
+static const struct file_operations lensl_trace_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lensl_trace_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
 };
 
-enum { KE_KEY, KE_END };
+#endif /* LENSL_CONFIG_TRACE */
 
-static struct key_entry ec_keymap[] = {
-	/* Fn F2 */
-	{KE_KEY, 0x0B, KEY_COFFEE },
-	/* Fn F3 */
-	{KE_KEY, 0x0C, KEY_BATTERY },
-	/* Fn F4; dispatches an ACPI event */
-	{KE_KEY, 0x0D, /* KEY_SLEEP */ KEY_RESERVED },
-	/* Fn F5; FIXME: should this be KEY_BLUETOOTH? */
-	{KE_KEY, 0x0E, KEY_WLAN },
-	/* Fn F7; dispatches an ACPI event */
-	{KE_KEY, 0x10, /* KEY_SWITCHVIDEOMODE */ KEY_RESERVED },
-	/* Fn F8 - ultranav; FIXME: find some keycode that fits this properly */
-	{KE_KEY, 0x11, KEY_PROG1 },
-	/* Fn F9 */
-	{KE_KEY, 0x12, KEY_EJECTCD },
-	/* Fn F12 */
-	{KE_KEY, 0x15, KEY_SUSPEND },
-	{KE_KEY, 0x69, KEY_VOLUMEUP },
-	{KE_KEY, 0x6A, KEY_VOLUMEDOWN },
-	{KE_KEY, 0x6B, KEY_MUTE },
-	/* Fn Home; dispatches an ACPI event */
-	{KE_KEY, 0x6C, KEY_BRIGHTNESSDOWN /*KEY_RESERVED*/ },
-	/* Fn End; dispatches an ACPI event */
-	{KE_KEY, 0x6D, KEY_BRIGHTNESSUP /*KEY_RESERVED*/ },
-	/* Fn spacebar - zoom */
-	{KE_KEY, 0x71, KEY_ZOOM },
-	/* Lenovo Care key */
-	{KE_KEY, 0x80, KEY_VENDOR },
-	{KE_END, 0},
-};
+/* Hotkey injection: write whitespace-separated scancodes, each
+   optionally followed by ":<us>" to wait that long before it, e.g.
+   "0x6c 0x6d:500 0x0b:20000". They go through hkey_dispatch() like
+   scancodes read from the EC. A wait is at most LENSL_HKEY_INJECT_MAX_US
+   and is cut short by a signal. */
+#define LENSL_HKEY_INJECT_MAX_US 10000000
 
-static int ec_scancode_to_keycode(u8 scancode)
+static ssize_t lensl_hkey_inject_write(struct file *file,
+			const char __user *ubuf, size_t count, loff_t *ppos)
 {
-	struct key_entry *key;
-
-	for (key = ec_keymap; key->type != KE_END; key++)
-		if (scancode == key->scancode)
-			return key->keycode;
-
-	return -EINVAL;
-}
+	char *buf, *p, *tok;
+	unsigned long scancode, us;
+	int res = count;
 
-static int hkey_inputdev_getkeycode(struct input_dev *dev, int scancode,
-					int *keycode)
-{
-	int result;
+	if (!lensl->hkey_inputdev)
+		return -ENODEV;
+	if (count > PAGE_SIZE)
+		return -E2BIG;
+	buf = kmalloc(count + 1, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_user(buf, ubuf, count)) {
+		kfree(buf);
+		return -EFAULT;
+	}
+	buf[count] = 0;
 
-	if (!dev)
-		return -EINVAL;
+	p = buf;
+	while ((tok = strsep(&p, " \t\n"))) {
+		char *delay;
 
-	result = ec_scancode_to_keycode(scancode);
-	if (result >= 0) {
-		*keycode = result;
-		return 0;
+		if (!*tok)
+			continue;
+		delay = strchr(tok, ':');
+		if (delay)
+			*delay++ = 0;
+		if (strict_strtoul(tok, 0, &scancode) || scancode > 0xff ||
+		    (delay && (strict_strtoul(delay, 0, &us) ||
+			       us > LENSL_HKEY_INJECT_MAX_US))) {
+			res = -EINVAL;
+			break;
+		}
+		if (delay) {
+			if (us >= 1000 && msleep_interruptible(us / 1000)) {
+				res = -EINTR;
+				break;
+			}
+			udelay(us % 1000);
+		}
+		spin_lock(&hkey_stats.lock);
+		hkey_stats.injected++;
+		spin_unlock(&hkey_stats.lock);
+		hkey_dispatch(scancode);
+		if (signal_pending(current)) {
+			res = -EINTR;
+			break;
+		}
 	}
-	return result;
+	kfree(buf);
+	return res;
 }
 
-static int hkey_inputdev_setkeycode(struct input_dev *dev, int scancode,
-					int keycode)
-{
-	struct key_entry *key;
-
-	if (!dev)
-		return -EINVAL;
+static const struct file_operations lensl_hkey_inject_fops = {
+	.owner		= THIS_MODULE,
+	.write		= lensl_hkey_inject_write,
+};
 
-	for (key = ec_keymap; key->type != KE_END; key++)
-		if (scancode == key->scancode) {
-			clear_bit(key->keycode, dev->keybit);
-			key->keycode = keycode;
-			set_bit(key->keycode, dev->keybit);
-			return 0;
-		}
+static int lensl_hkey_stats_show(struct seq_file *m, void *v)
+{
+	unsigned long hist[LENSL_HKEY_HIST];
+	unsigned long polled, injected, delivered, swallowed;
+	unsigned long errors[2], recoveries;
+	unsigned long tears, retries, deferred;
+	u64 ns, max_ns;
+	int i;
 
-	return -EINVAL;
+	spin_lock(&hkey_stats.lock);
+	memcpy(errors, hkey_stats.errors, sizeof(errors));
+	recoveries = hkey_stats.recoveries;
+	tears = hkey_stats.ring_tears;
+	retries = hkey_stats.ring_retries;
+	deferred = hkey_stats.ring_deferred;
+	polled = hkey_stats.polled;
+	injected = hkey_stats.injected;
+	delivered = hkey_stats.delivered;
+	swallowed = hkey_stats.swallowed;
+	ns = hkey_stats.ns;
+	max_ns = hkey_stats.max_ns;
+	memcpy(hist, hkey_stats.hist, sizeof(hist));
+	spin_unlock(&hkey_stats.lock);
+
+	seq_printf(m, "polled: %lu\ninjected: %lu\n", polled, injected);
+	seq_printf(m, "delivered: %lu\nswallowed: %lu\n",
+		delivered, swallowed);
+	seq_printf(m, "offset_errors: %lu\nring_errors: %lu\n"
+		"recoveries: %lu\nbackoff: %d\n", errors[LENSL_HKEY_ERR_OFFSET],
+		errors[LENSL_HKEY_ERR_RING], recoveries, lensl->hkey_backoff);
+	seq_printf(m, "ring_tears: %lu\nring_retries: %lu\n"
+		"ring_deferred: %lu\n", tears, retries, deferred);
+	seq_printf(m, "mean_ns: %llu\nmax_ns: %llu\n",
+		delivered + swallowed ? (unsigned long long)
+			div64_u64(ns, delivered + swallowed) : 0ULL,
+		(unsigned long long)max_ns);
+	for (i = 0; i < LENSL_HKEY_HIST; i++)
+		seq_printf(m, "%s%u_us: %lu\n",
+			i == LENSL_HKEY_HIST - 1 ? ">=" : "<",
+			i == LENSL_HKEY_HIST - 1 ? 1 << (i - 1) : 1 << i,
+			hist[i]);
+	return 0;
 }
 
-static int hkey_ec_get_offset(void)
+static int lensl_hkey_stats_open(struct inode *inode, struct file *file)
 {
-	/* Hotkey events are stored in EC registers 0x0A .. 0x11
-	 * Address of last event is stored in EC registers 0x12 and
-	 * 0x14; if address is 0x01, last event is in register 0x0A;
-	 * if address is 0x07, last event is in register 0x10;
-	 * if address is 0x00, last event is in register 0x11 */
+	return single_open(file, lensl_hkey_stats_show, NULL);
+}
 
-	u8 offset;
+static const struct file_operations lensl_hkey_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lensl_hkey_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	if (ec_read(0x12, &offset))
-		return -EINVAL;
-	if (!offset)
-		offset = 8;
-	offset -= 1;
-	if (offset > 7)
-		return -EINVAL;
-	return offset;
+static int lensl_fan_writes_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&lensl->fan_mutex);
+	seq_printf(m, "requests: %lu\ncommits: %lu\nerrors: %lu\n",
+		lensl->fan_stats.requests, lensl->fan_stats.commits,
+		lensl->fan_stats.errors);
+	seq_printf(m, "sfnv_saved: %lu\ndecf_saved: %lu\npending: %d\n",
+		lensl->fan_stats.sfnv_saved, lensl->fan_stats.decf_saved,
+		lensl->fan_write_pending);
+	mutex_unlock(&lensl->fan_mutex);
+	return 0;
 }
 
-static int hkey_poll_kthread(void *data)
+static int lensl_fan_writes_open(struct inode *inode, struct file *file)
 {
-	unsigned long t = 0;
-	int offset, level;
-	unsigned int keycode;
-	u8 scancode;
-
-	mutex_lock(&hkey_poll_mutex);
-
-	offset = hkey_ec_get_offset();
-	if (offset < 0) {
-		vdbg_printk(LENSL_WARNING,
-			"Failed to read hotkey register offset from EC\n");
-		hkey_ec_prev_offset = 0;
-	} else
-		hkey_ec_prev_offset = offset;
+	return single_open(file, lensl_fan_writes_show, NULL);
+}
 
-	while (!kthread_should_stop() && hkey_poll_hz) {
-		if (t == 0)
-			t = 1000/hkey_poll_hz;
-		t = msleep_interruptible(t);
-		if (unlikely(kthread_should_stop()))
-			break;
-		try_to_freeze();
-		if (t > 0)
-			continue;
-		offset = hkey_ec_get_offset();
-		if (offset < 0) {
-			vdbg_printk(LENSL_WARNING,
-			   "Failed to read hotkey register offset from EC\n");
-			continue;
-		}
-		if (offset == hkey_ec_prev_offset)
-			continue;
+static const struct file_operations lensl_fan_writes_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lensl_fan_writes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-		if (ec_read(0x0A + offset, &scancode)) {
-			vdbg_printk(LENSL_WARNING,
-				"Failed to read hotkey code from EC\n");
-			continue;
-		}
-		keycode = ec_scancode_to_keycode(scancode);
-		vdbg_printk(LENSL_DEBUG,
-		   "Got hotkey keycode %d (scancode %d)\n", keycode, scancode);
-
-		/* Special handling for brightness keys. We do it here and not
-		   via an ACPI notifier in order to prevent possible conflicts
-		   with video.c */
-		if (keycode == KEY_BRIGHTNESSDOWN) {
-			if (control_backlight && backlight) {
-				level = lensl_bd_get_brightness(backlight);
-				if (0 <= --level)
-					lensl_bd_set_brightness_int(level);
-			} else
-				keycode = KEY_RESERVED;
-		} else if (keycode == KEY_BRIGHTNESSUP) {
-			if (control_backlight && backlight) {
-				level = lensl_bd_get_brightness(backlight);
-				if (backlight_levels.count > ++level)
-					lensl_bd_set_brightness_int(level);
-			} else
-				keycode = KEY_RESERVED;
-		}
+static void lensl_cost_ec_totals(unsigned long *bytes, u64 *ns, u64 *wait_ns)
+{
+	unsigned long flags;
+	int i;
 
-		if (keycode != KEY_RESERVED) {
-			input_report_key(hkey_inputdev, keycode, 1);
-			input_sync(hkey_inputdev);
-			input_report_key(hkey_inputdev, keycode, 0);
-			input_sync(hkey_inputdev);
-		}
-		hkey_ec_prev_offset = offset;
+	*bytes = 0;
+	*ns = *wait_ns = 0;
+	spin_lock_irqsave(&lensl_ec_stats.lock, flags);
+	for (i = 0; i < LENSL_EC_MODES; i++) {
+		*bytes += lensl_ec_stats.bytes[i];
+		*ns += lensl_ec_stats.ns[i];
 	}
-
-	mutex_unlock(&hkey_poll_mutex);
-	return 0;
+	spin_unlock_irqrestore(&lensl_ec_stats.lock, flags);
+	spin_lock(&lensl_ec_sched.lock);
+	for (i = 0; i < LENSL_EC_CLASSES; i++)
+		*wait_ns += lensl_ec_sched.queued_ns[i];
+	spin_unlock(&lensl_ec_sched.lock);
 }
 
-static void hkey_poll_start(void)
+static void lensl_cost_rate(struct seq_file *m, const char *name,
+		unsigned long count, u64 ms)
 {
-	hkey_ec_prev_offset = 0;
-	mutex_lock(&hkey_poll_mutex);
-	hkey_poll_task = kthread_run(hkey_poll_kthread,
-		NULL, LENSL_HKEY_POLL_KTHREAD_NAME);
-	if (IS_ERR(hkey_poll_task)) {
-		hkey_poll_task = NULL;
-		vdbg_printk(LENSL_ERR,
-			"Could not create kernel thread for hotkey polling\n");
-	}
-	mutex_unlock(&hkey_poll_mutex);
+	u64 milli = ms ? div64_u64((u64)count * 1000000, ms) : 0;
+	u32 frac;
+	u64 whole = div_u64_rem(milli, 1000, &frac);
+
+	seq_printf(m, "%s: %lu\n%s_per_s: %llu.%03u\n", name, count, name,
+		(unsigned long long)whole, frac);
 }
 
-static void hkey_poll_stop(void)
+/* one "name: value" pair per line; rates are averaged since the module
+   was loaded or the file was last written to */
+static int lensl_cost_show(struct seq_file *m, void *v)
 {
-	if (hkey_poll_task) {
-		if (frozen(hkey_poll_task) || freezing(hkey_poll_task))
-			thaw_process(hkey_poll_task);
+	unsigned long wakeups[LENSL_WAKE_SOURCES], total = 0;
+	unsigned long user_calls, acpi_calls, ec_bytes;
+	unsigned long allocs, allocs_avoided;
+	u64 acpi_ns, ec_ns, ec_wait_ns, ms;
+	char name[32];
+	int i;
 
-		kthread_stop(hkey_poll_task);
-		hkey_poll_task = NULL;
-		mutex_lock(&hkey_poll_mutex);
-		/* at this point, the thread did exit */
-		mutex_unlock(&hkey_poll_mutex);
+	lensl_cost_ec_totals(&ec_bytes, &ec_ns, &ec_wait_ns);
+	spin_lock(&lensl_cost.lock);
+	memcpy(wakeups, lensl_cost.wakeups, sizeof(wakeups));
+	user_calls = lensl_cost.user_calls;
+	acpi_calls = lensl_cost.acpi_calls;
+	acpi_ns = lensl_cost.acpi_ns;
+	allocs = lensl_cost.allocs;
+	allocs_avoided = lensl_cost.allocs_avoided;
+	ec_bytes -= lensl_cost.ec_bytes_base;
+	ec_ns -= lensl_cost.ec_ns_base;
+	ec_wait_ns -= lensl_cost.ec_wait_ns_base;
+	ms = div_u64(ktime_to_ns(ktime_sub(ktime_get(), lensl_cost.since)),
+		NSEC_PER_MSEC);
+	spin_unlock(&lensl_cost.lock);
+
+	seq_printf(m, "elapsed_ms: %llu\n", (unsigned long long)ms);
+	for (i = 0; i < LENSL_WAKE_SOURCES; i++) {
+		snprintf(name, sizeof(name), "wakeups_%s", lensl_wake_names[i]);
+		lensl_cost_rate(m, name, wakeups[i], ms);
+		total += wakeups[i];
 	}
+	lensl_cost_rate(m, "wakeups_total", total, ms);
+	lensl_cost_rate(m, "user_fw_calls", user_calls, ms);
+	seq_printf(m, "acpi_calls: %lu\nacpi_ns: %llu\n", acpi_calls,
+		(unsigned long long)acpi_ns);
+	seq_printf(m, "allocs: %lu\nallocs_avoided: %lu\n", allocs,
+		allocs_avoided);
+	seq_printf(m, "ec_bytes: %lu\nec_ns: %llu\nec_wait_ns: %llu\n",
+		ec_bytes, (unsigned long long)ec_ns,
+		(unsigned long long)ec_wait_ns);
+	return 0;
 }
 
-static void hkey_inputdev_exit(void)
+/* any write starts a new measurement window */
+static ssize_t lensl_cost_write(struct file *file,
+			const char __user *ubuf, size_t count, loff_t *ppos)
 {
-	if (hkey_inputdev)
-		input_unregister_device(hkey_inputdev);
-	hkey_inputdev = NULL;
+	unsigned long ec_bytes;
+	u64 ec_ns, ec_wait_ns;
+
+	lensl_cost_ec_totals(&ec_bytes, &ec_ns, &ec_wait_ns);
+	spin_lock(&lensl_cost.lock);
+	memset(lensl_cost.wakeups, 0, sizeof(lensl_cost.wakeups));
+	lensl_cost.user_calls = lensl_cost.acpi_calls = 0;
+	lensl_cost.acpi_ns = 0;
+	lensl_cost.allocs = lensl_cost.allocs_avoided = 0;
+	lensl_cost.ec_bytes_base = ec_bytes;
+	lensl_cost.ec_ns_base = ec_ns;
+	lensl_cost.ec_wait_ns_base = ec_wait_ns;
+	lensl_cost.since = ktime_get();
+	spin_unlock(&lensl_cost.lock);
+	return count;
 }
 
-static int hkey_inputdev_init(void)
+static int lensl_cost_open(struct inode *inode, struct file *file)
 {
-	int result;
-	struct key_entry *key;
+	return single_open(file, lensl_cost_show, NULL);
+}
 
-	hkey_inputdev = input_allocate_device();
-	if (!hkey_inputdev) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to allocate hotkey input device\n");
-		return -ENODEV;
-	}
-	hkey_inputdev->name = "Lenovo ThinkPad SL Series extra buttons";
-	hkey_inputdev->phys = LENSL_HKEY_FILE "/input0";
-	hkey_inputdev->uniq = LENSL_HKEY_FILE;
-	hkey_inputdev->id.bustype = BUS_HOST;
-	hkey_inputdev->id.vendor = PCI_VENDOR_ID_LENOVO;
-	hkey_inputdev->getkeycode = hkey_inputdev_getkeycode;
-	hkey_inputdev->setkeycode = hkey_inputdev_setkeycode;
-	set_bit(EV_KEY, hkey_inputdev->evbit);
+static const struct file_operations lensl_cost_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lensl_cost_open,
+	.read		= seq_read,
+	.write		= lensl_cost_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	for (key = ec_keymap; key->type != KE_END; key++)
-		set_bit(key->keycode, hkey_inputdev->keybit);
+static void lensl_debugfs_exit(void)
+{
+	debugfs_remove_recursive(lensl_debugfs_dir);
+	lensl_debugfs_dir = NULL;
+}
 
-	result = input_register_device(hkey_inputdev);
-	if (result) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to register hotkey input device\n");
-		input_free_device(hkey_inputdev);
-		hkey_inputdev = NULL;
+static int lensl_debugfs_init(void)
+{
+	lensl_debugfs_dir = debugfs_create_dir(LENSL_MODULE_NAME, NULL);
+	if (!lensl_debugfs_dir || IS_ERR(lensl_debugfs_dir)) {
+		lensl_debugfs_dir = NULL;
 		return -ENODEV;
 	}
-	vdbg_printk(LENSL_DEBUG, "Initialized hotkey subdriver\n");
+	debugfs_create_file("ec_transport", S_IRUSR, lensl_debugfs_dir,
+			NULL, &lensl_ec_transport_fops);
+	debugfs_create_file("ec_sched", S_IRUSR, lensl_debugfs_dir,
+			NULL, &lensl_ec_sched_fops);
+	debugfs_create_file("hotkey_inject", S_IWUSR, lensl_debugfs_dir,
+			NULL, &lensl_hkey_inject_fops);
+	debugfs_create_file("hotkey_stats", S_IRUSR, lensl_debugfs_dir,
+			NULL, &lensl_hkey_stats_fops);
+	debugfs_create_file("fan_writes", S_IRUSR, lensl_debugfs_dir,
+			NULL, &lensl_fan_writes_fops);
+	if (lensl->fan_ring)
+		debugfs_create_file("fan_history", S_IRUSR, lensl_debugfs_dir,
+				NULL, &fan_history_fops);
+	debugfs_create_file("cost", S_IRUSR | S_IWUSR, lensl_debugfs_dir,
+			NULL, &lensl_cost_fops);
+	battery_debugfs_init(lensl_debugfs_dir);
+#if LENSL_CONFIG_TRACE
+	if (lensl_trace.ring)
+		debugfs_create_file("trace", S_IRUSR, lensl_debugfs_dir,
+				NULL, &lensl_trace_fops);
+	debugfs_create_file("trace_stats", S_IRUSR, lensl_debugfs_dir,
+			NULL, &lensl_trace_stats_fops);
+#endif
 	return 0;
 }
 
-
 /*************************************************************************
-    procfs debugging interface
+    perf events
  *************************************************************************/
 
-#define LENSL_PROC_EC "ec0"
-#define LENSL_PROC_DIRNAME LENSL_MODULE_NAME
-
-static struct proc_dir_entry *proc_dir;
+/* A software PMU named LENSL_PMU_NAME, so that perf can count driver
+   activity next to the CPU events of a workload, e.g.
+   perf stat -a -e lenovo_sl/ec_reads/,lenovo_sl/acpi_ec0/ -I 1000
+   The events (enum lensl_perf_event) are listed in the events directory
+   of the PMU in sysfs. They are global counters without an overflow
+   interrupt, so they can be counted system-wide but not sampled, and
+   cpumask tells perf to open them on one CPU only.
+   fan_rpm is a sampled value rather than a count: each update adds the
+   last speed measured by the fan sampler or the watch, times the
+   milliseconds since the previous update, so that the count divided by
+   the time it ran is the mean fan speed (its scale makes perf print it
+   in rpm-seconds), and perf stat -I 1000 prints the mean speed of each
+   second. It never accesses the firmware, as pmu->read runs with
+   interrupts disabled.
+   struct pmu has no owner module on the kernels this driver builds
+   for, so each event pins the module until perf destroys it. */
+
+#if LENSL_PERF
+
+static struct pmu lensl_pmu;
+static int lensl_pmu_registered;
+
+/* the value whose increments the event counts: fan_rpm advances with
+   the time, weighted by the speed in lensl_pmu_update() */
+static u64 lensl_pmu_value(int event)
+{
+	if (event == LENSL_PERF_FAN_RPM)
+		return div_u64(ktime_to_ns(ktime_get()), NSEC_PER_MSEC);
+	return atomic_long_read(&lensl_perf_counts[event]);
+}
 
-int lensl_ec_read_procmem(char *buf, char **start, off_t offset,
-		int count, int *eof, void *data)
+static void lensl_pmu_update(struct perf_event *event)
 {
-	int err, len = 0;
-	u8 i, result;
-	/* note: ec_read at i = 255 locks up my SL300 hard. -AR */
-	for (i = 0; i < 255; i++) {
-		if (!(i % 16)) {
-			if (i)
-				len += sprintf(buf+len, "\n");
-			len += sprintf(buf+len, "%02X:", i);
-		}
-		err = ec_read(i, &result);
-		if (!err)
-			len += sprintf(buf+len, " %02X", result);
-		else
-			len += sprintf(buf+len, " **");
-	}
-	len += sprintf(buf+len, "\n");
-	*eof = 1;
-	return len;
+	int config = event->attr.config;
+	u64 prev, delta, now = lensl_pmu_value(config);
+
+	prev = local64_xchg(&event->hw.prev_count, now);
+	delta = now - prev;
+	if (config == LENSL_PERF_FAN_RPM)
+		delta *= atomic_long_read(&lensl_perf_counts[config]);
+	local64_add(delta, &event->count);
 }
 
-/* we expect input in the format "%02X %02X", where the first number is
-   the EC register and the second is the value to be written */
-int lensl_ec_write_procmem(struct file *file, const char *buffer,
-				unsigned long count, void *data)
+static void lensl_pmu_event_destroy(struct perf_event *event)
 {
-	char s[7];
-	unsigned int reg, val;
+	module_put(THIS_MODULE);
+}
 
-	if (count > 6)
+static int lensl_pmu_event_init(struct perf_event *event)
+{
+	if (event->attr.type != lensl_pmu.type)
+		return -ENOENT;
+	if (event->attr.config >= __LENSL_PERF_MAX)
 		return -EINVAL;
-	memset(s, 0, 7);
-	if (copy_from_user(s, buffer, count))
-		return -EFAULT;
-	if (sscanf(s, "%02X %02X", &reg, &val) < 2)
+	if (event->cpu < 0 || is_sampling_event(event))
 		return -EINVAL;
-	if (reg > 255 || val > 255)
+	/* the driver's activity cannot be told apart by privilege level */
+	if (event->attr.exclude_user || event->attr.exclude_kernel ||
+	    event->attr.exclude_hv || event->attr.exclude_idle)
 		return -EINVAL;
-	if (ec_write(reg, val))
-		return -EIO;
-	return count;
+	if (!try_module_get(THIS_MODULE))
+		return -ENODEV;
+	event->destroy = lensl_pmu_event_destroy;
+	return 0;
 }
 
-static void lenovo_sl_procfs_exit(void)
+static void lensl_pmu_start(struct perf_event *event, int flags)
 {
-	if (proc_dir) {
-		remove_proc_entry(LENSL_PROC_EC, proc_dir);
-		remove_proc_entry(LENSL_PROC_DIRNAME, acpi_root_dir);
-	}
+	local64_set(&event->hw.prev_count,
+		lensl_pmu_value(event->attr.config));
+	event->hw.state = 0;
 }
 
-static int lenovo_sl_procfs_init(void)
+static void lensl_pmu_stop(struct perf_event *event, int flags)
 {
-	struct proc_dir_entry *proc_ec;
+	if (event->hw.state & PERF_HES_STOPPED)
+		return;
+	lensl_pmu_update(event);
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
 
-	proc_dir = proc_mkdir(LENSL_PROC_DIRNAME, acpi_root_dir);
-	if (!proc_dir) {
-		vdbg_printk(LENSL_ERR,
-		   "Failed to create proc dir acpi/%s/\n", LENSL_PROC_DIRNAME);
-		return -ENOENT;
+static int lensl_pmu_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		lensl_pmu_start(event, flags);
+	return 0;
+}
+
+static void lensl_pmu_del(struct perf_event *event, int flags)
+{
+	lensl_pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static void lensl_pmu_read(struct perf_event *event)
+{
+	lensl_pmu_update(event);
+}
+
+struct lensl_pmu_event_attr {
+	struct device_attribute attr;
+	int id;
+};
+
+static ssize_t lensl_pmu_event_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct lensl_pmu_event_attr *ea =
+		container_of(attr, struct lensl_pmu_event_attr, attr);
+
+	return sprintf(buf, "event=0x%02x\n", ea->id);
+}
+
+#define LENSL_PMU_EVENT(_name, _id) \
+	static struct lensl_pmu_event_attr lensl_pmu_event_##_name = { \
+		.attr = __ATTR(_name, S_IRUGO, lensl_pmu_event_show, NULL), \
+		.id = _id, \
 	}
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,29)
-	proc_dir->owner = THIS_MODULE;
-#endif
-	proc_ec = create_proc_entry(LENSL_PROC_EC, 0600, proc_dir);
-	if (!proc_ec) {
-		vdbg_printk(LENSL_ERR,
-			"Failed to create proc entry acpi/%s/%s\n",
-			LENSL_PROC_DIRNAME, LENSL_PROC_EC);
-		return -ENOENT;
+
+LENSL_PMU_EVENT(ec_reads, LENSL_PERF_EC_READS);
+LENSL_PMU_EVENT(ec_writes, LENSL_PERF_EC_WRITES);
+LENSL_PMU_EVENT(acpi_hkey, LENSL_PERF_ACPI_HKEY);
+LENSL_PMU_EVENT(acpi_ec0, LENSL_PERF_ACPI_EC0);
+LENSL_PMU_EVENT(acpi_lcdd, LENSL_PERF_ACPI_LCDD);
+LENSL_PMU_EVENT(hotkeys_delivered, LENSL_PERF_HOTKEYS_DELIVERED);
+LENSL_PMU_EVENT(hotkeys_swallowed, LENSL_PERF_HOTKEYS_SWALLOWED);
+LENSL_PMU_EVENT(backlight_changes, LENSL_PERF_BACKLIGHT_CHANGES);
+LENSL_PMU_EVENT(fan_rpm, LENSL_PERF_FAN_RPM);
+
+/* fan_rpm counts rpm-milliseconds */
+static ssize_t lensl_pmu_string_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dev_ext_attribute *ea =
+		container_of(attr, struct dev_ext_attribute, attr);
+
+	return sprintf(buf, "%s\n", (char *)ea->var);
+}
+
+#define LENSL_PMU_STRING(_name, _file, _value) \
+	static struct dev_ext_attribute lensl_pmu_string_##_name = { \
+		.attr = { \
+			.attr = { .name = _file, .mode = S_IRUGO }, \
+			.show = lensl_pmu_string_show, \
+		}, \
+		.var = _value, \
 	}
-	proc_ec->read_proc = lensl_ec_read_procmem;
-	proc_ec->write_proc = lensl_ec_write_procmem;
-	vdbg_printk(LENSL_DEBUG, "Initialized procfs debugging interface\n");
 
+LENSL_PMU_STRING(fan_rpm_scale, "fan_rpm.scale", "0.001");
+LENSL_PMU_STRING(fan_rpm_unit, "fan_rpm.unit", "rpm-seconds");
+
+static struct attribute *lensl_pmu_events[] = {
+	&lensl_pmu_event_ec_reads.attr.attr,
+	&lensl_pmu_event_ec_writes.attr.attr,
+	&lensl_pmu_event_acpi_hkey.attr.attr,
+	&lensl_pmu_event_acpi_ec0.attr.attr,
+	&lensl_pmu_event_acpi_lcdd.attr.attr,
+	&lensl_pmu_event_hotkeys_delivered.attr.attr,
+	&lensl_pmu_event_hotkeys_swallowed.attr.attr,
+	&lensl_pmu_event_backlight_changes.attr.attr,
+	&lensl_pmu_event_fan_rpm.attr.attr,
+	&lensl_pmu_string_fan_rpm_scale.attr.attr,
+	&lensl_pmu_string_fan_rpm_unit.attr.attr,
+	NULL
+};
+
+static const struct attribute_group lensl_pmu_events_group = {
+	.name = "events",
+	.attrs = lensl_pmu_events,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *lensl_pmu_formats[] = {
+	&format_attr_event.attr,
+	NULL
+};
+
+static const struct attribute_group lensl_pmu_format_group = {
+	.name = "format",
+	.attrs = lensl_pmu_formats,
+};
+
+static ssize_t lensl_pmu_cpumask_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", cpumask_first(cpu_online_mask));
+}
+
+static DEVICE_ATTR(cpumask, S_IRUGO, lensl_pmu_cpumask_show, NULL);
+
+static struct attribute *lensl_pmu_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL
+};
+
+static const struct attribute_group lensl_pmu_attr_group = {
+	.attrs = lensl_pmu_attrs,
+};
+
+static const struct attribute_group *lensl_pmu_attr_groups[] = {
+	&lensl_pmu_attr_group,
+	&lensl_pmu_format_group,
+	&lensl_pmu_events_group,
+	NULL
+};
+
+static struct pmu lensl_pmu = {
+	.task_ctx_nr	= perf_invalid_context,
+	.attr_groups	= lensl_pmu_attr_groups,
+	.event_init	= lensl_pmu_event_init,
+	.add		= lensl_pmu_add,
+	.del		= lensl_pmu_del,
+	.start		= lensl_pmu_start,
+	.stop		= lensl_pmu_stop,
+	.read		= lensl_pmu_read,
+};
+
+static void lensl_pmu_exit(void)
+{
+	if (!lensl_pmu_registered)
+		return;
+	perf_pmu_unregister(&lensl_pmu);
+	lensl_pmu_registered = 0;
+}
+
+static int lensl_pmu_init(void)
+{
+	int res;
+
+	res = perf_pmu_register(&lensl_pmu, LENSL_PMU_NAME, -1);
+	if (res) {
+		vdbg_printk(LENSL_ERR, "Failed to register perf PMU\n");
+		return res;
+	}
+	lensl_pmu_registered = 1;
+	vdbg_printk(LENSL_DEBUG, "Registered perf PMU %s\n", LENSL_PMU_NAME);
 	return 0;
 }
 
+#else /* LENSL_PERF */
+
+static void lensl_pmu_exit(void)
+{
+}
+
+static int lensl_pmu_init(void)
+{
+	return -ENODEV;
+}
+
+#endif /* LENSL_PERF */
+
 /*************************************************************************
     init/exit
  *************************************************************************/
 
-static int __init lenovo_sl_laptop_init(void)
+/* init steps that fault_init can make fail; the steps before
+   LENSL_INIT_RADIOS are required and abort the load, except for
+   LENSL_INIT_NETLINK, which like the others only leaves its feature
+   out. The steps from LENSL_INIT_HANDLES on are taken by
+   lensl_probe(). */
+enum {
+	LENSL_INIT_WORKQUEUE = 1,
+	LENSL_INIT_NETLINK,
+	LENSL_INIT_DRIVER,
+	LENSL_INIT_DEVICE,
+	LENSL_INIT_HANDLES,
+	LENSL_INIT_TRACE,
+	LENSL_INIT_HKEY_INPUT,
+	LENSL_INIT_RADIOS,
+	LENSL_INIT_BACKLIGHT,
+	LENSL_INIT_LED,
+	LENSL_INIT_HKEY_POLL,
+	LENSL_INIT_HWMON,
+	LENSL_INIT_ACCEL,
+	LENSL_INIT_BATTERY,
+	LENSL_INIT_CHARDEV,
+	LENSL_INIT_PLATFORM_ATTRS,
+	LENSL_INIT_PROCFS,
+	LENSL_INIT_DEBUGFS,
+	LENSL_INIT_PMU,
+};
+
+static const char *lensl_init_steps[] = {
+	NULL, "workqueue", "netlink", "platform driver", "platform device",
+	"ACPI handles", "trace", "hotkey input device", "radios",
+	"backlight", "LED", "hotkey poller", "hwmon", "accelerometer",
+	"battery", "character device", "platform attributes", "procfs",
+	"debugfs", "perf PMU",
+};
+
+static int lensl_fault(int step)
+{
+	if (fault_init != step)
+		return 0;
+	vdbg_printk(LENSL_WARNING, "Injected failure at init step %d (%s)\n",
+		step, lensl_init_steps[step]);
+	return -ENOMEM;
+}
+
+/* set up the subdrivers on the device being probed, in init step order */
+static int lensl_setup(void)
 {
 	int ret;
 	acpi_status status;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
-	if (!acpi_video_backlight_support())
-		control_backlight = 1;
+	ret = lensl_fault(LENSL_INIT_HANDLES);
+	if (ret)
+		return ret;
+#if LENSL_CONFIG_TRACE
+	if (lensl_fw_virtual()) {
+		lensl->hkey_handle = &lensl_replay_handles[0];
+		lensl->ec0_handle = &lensl_replay_handles[1];
+	} else {
 #endif
-
-	hkey_handle = ec0_handle = NULL;
-
-	if (acpi_disabled)
-		return -ENODEV;
-
-	lensl_wq = create_singlethread_workqueue(LENSL_WORKQUEUE_NAME);
-	if (!lensl_wq) {
-		vdbg_printk(LENSL_ERR, "Failed to create a workqueue\n");
-		return -ENOMEM;
-	}
-
-	status = acpi_get_handle(NULL, LENSL_HKEY, &hkey_handle);
+	status = acpi_get_handle(NULL, LENSL_HKEY, &lensl->hkey_handle);
 	if (ACPI_FAILURE(status)) {
 		vdbg_printk(LENSL_ERR,
 			"Failed to get ACPI handle for %s\n", LENSL_HKEY);
 		return -ENODEV;
 	}
-	status = acpi_get_handle(NULL, LENSL_EC0, &ec0_handle);
+	status = acpi_get_handle(NULL, LENSL_EC0, &lensl->ec0_handle);
 	if (ACPI_FAILURE(status)) {
 		vdbg_printk(LENSL_ERR,
 			"Failed to get ACPI handle for %s\n", LENSL_EC0);
 		return -ENODEV;
 	}
-
-	lensl_pdev = platform_device_register_simple(LENSL_DRVR_NAME, -1,
-							NULL, 0);
-	if (IS_ERR(lensl_pdev)) {
-		ret = PTR_ERR(lensl_pdev);
-		lensl_pdev = NULL;
-		vdbg_printk(LENSL_ERR, "Failed to register platform device\n");
-		return ret;
+#if LENSL_CONFIG_TRACE
 	}
+#endif
 
-	ret = hkey_inputdev_init();
+	ret = lensl_fault(LENSL_INIT_TRACE);
+	if (!ret)
+		ret = lensl_trace_init();
 	if (ret)
+		return ret;
+
+	ret = lensl_fault(LENSL_INIT_HKEY_INPUT);
+	if (!ret)
+		ret = hkey_inputdev_init();
+	if (ret) {
+		lensl_trace_exit();
 		return -ENODEV;
+	}
 
-	radio_init(LENSL_BLUETOOTH);
-	radio_init(LENSL_WWAN);
-	radio_init(LENSL_UWB);
-	if (control_backlight)
+	/* from here on, a failure only leaves the feature out */
+	if (!lensl_fault(LENSL_INIT_RADIOS)) {
+		radio_init(LENSL_BLUETOOTH);
+		radio_init(LENSL_WWAN);
+#if LENSL_CONFIG_UWB
+		radio_init(LENSL_UWB);
+#endif
+	}
+	/* the backlight reads _BCL and installs a notify handler on the LCD
+	   device, neither of which can be replayed or simulated */
+	if (control_backlight && !lensl_fw_virtual() &&
+	    !lensl_fault(LENSL_INIT_BACKLIGHT))
 		backlight_init();
 
-	led_init();
-	mutex_init(&hkey_poll_mutex);
-	hkey_poll_start();
-	hwmon_init();
-
-	if (debug_ec)
+	if (!lensl_fault(LENSL_INIT_LED))
+		led_init();
+	if (!lensl_fault(LENSL_INIT_HKEY_POLL))
+		hkey_poll_start();
+	if (!lensl_fault(LENSL_INIT_HWMON))
+		hwmon_init();
+	if (!lensl_fault(LENSL_INIT_ACCEL))
+		accel_init();
+	if (!lensl_fault(LENSL_INIT_BATTERY))
+		battery_init();
+	if (!lensl_fault(LENSL_INIT_CHARDEV))
+		lensl_dev_init();
+	if (!lensl_fault(LENSL_INIT_PLATFORM_ATTRS))
+		lensl_platform_attrs_init();
+	lensl_watch_start();
+
+	if (debug_ec && !lensl_fault(LENSL_INIT_PROCFS))
 		lenovo_sl_procfs_init();
-
-	vdbg_printk(LENSL_INFO, "Loaded Lenovo ThinkPad SL Series driver\n");
+	if (!lensl_fault(LENSL_INIT_DEBUGFS))
+		lensl_debugfs_init();
+	if (!lensl_fault(LENSL_INIT_PMU))
+		lensl_pmu_init();
 	return 0;
 }
 
-static void __exit lenovo_sl_laptop_exit(void)
+/* the reverse of lensl_setup(), from lensl_remove() */
+static void lensl_teardown(void)
 {
+	lensl_pmu_exit();
+	lensl_debugfs_exit();
 	lenovo_sl_procfs_exit();
+	lensl_watch_stop();
+	lensl_platform_attrs_exit();
+	lensl_dev_exit();
+	battery_exit();
+	accel_exit();
 	hwmon_exit();
 	hkey_poll_stop();
 	led_exit();
 	backlight_exit();
+#if LENSL_CONFIG_UWB
 	radio_exit(LENSL_UWB);
+#endif
 	radio_exit(LENSL_WWAN);
 	radio_exit(LENSL_BLUETOOTH);
 	hkey_inputdev_exit();
+	lensl_trace_exit();
+}
+
+static int lensl_probe(struct platform_device *pdev)
+{
+	struct lensl_priv *priv;
+	int i, ret;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	mutex_init(&priv->hkey_poll_mutex);
+	mutex_init(&priv->fan_mutex);
+	spin_lock_init(&priv->fan_ring_lock);
+#if LENSL_CONFIG_ACCEL
+	spin_lock_init(&priv->accel.lock);
+#endif
+	memcpy(priv->radios, lensl_radio_templates, sizeof(priv->radios));
+	for (i = 0; i < LENSL_RADIO_COUNT; i++)
+		priv->radios_last[i].result = -ENODEV;
+	priv->hkey_poll_hz = 5;
+	priv->pwm1_value = priv->pwm1_committed = -1;
+	priv->fan_mode_seen = priv->fan_rpm_seen = -1;
+	priv->watch_wlsw = -1;
+	/* the defaults of the driver match "balanced" */
+	priv->profile = 1;
+	priv->backlight_cap_pct = 100;
+	platform_set_drvdata(pdev, priv);
+	/* the subdrivers register their devices below pdev before
+	   platform_device_register_simple() has returned it */
+	lensl_pdev = pdev;
+	lensl = priv;
+
+	ret = lensl_setup();
+	if (ret) {
+		lensl = NULL;
+		platform_set_drvdata(pdev, NULL);
+		kfree(priv);
+	}
+	return ret;
+}
+
+static int lensl_remove(struct platform_device *pdev)
+{
+	struct lensl_priv *priv = platform_get_drvdata(pdev);
+
+	lensl_teardown();
+	lensl = NULL;
+	platform_set_drvdata(pdev, NULL);
+	kfree(priv);
+	return 0;
+}
+
+static struct platform_driver lensl_driver = {
+	.probe		= lensl_probe,
+	.remove		= lensl_remove,
+	.driver		= {
+		.name	= LENSL_DRVR_NAME,
+		.owner	= THIS_MODULE,
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,30)
+		/* there is one instance: the subdrivers register globally
+		   named devices (rfkill switches, input devices, backlight,
+		   LED, /dev/lenovo-sl, procfs and debugfs, the PMU) and keep
+		   module-wide state, so lensl_pdev is the only device and
+		   is not rebound through sysfs */
+		.suppress_bind_attrs = true,
+#endif
+	},
+};
+
+static int __init lenovo_sl_laptop_init(void)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	if (!acpi_video_backlight_support())
+		control_backlight = 1;
+#endif
+
+	lensl_cost.since = start;
+
+	/* a replayed capture or the simulator needs neither ACPI nor the EC */
+	if (acpi_disabled && !lensl_fw_virtual())
+		return -ENODEV;
+
+	/* dbg_level is read-only after load, so the key is flipped once */
+	if (dbg_level >= LENSL_DEBUG)
+		lensl_debug_key_inc();
+
+	lensl_wq = lensl_fault(LENSL_INIT_WORKQUEUE) ? NULL :
+		create_singlethread_workqueue(LENSL_WORKQUEUE_NAME);
+	if (!lensl_wq) {
+		vdbg_printk(LENSL_ERR, "Failed to create a workqueue\n");
+		ret = -ENOMEM;
+		goto err_key;
+	}
+
+	if (!lensl_fault(LENSL_INIT_NETLINK))
+		lensl_nl_init();
+
+	ret = lensl_fault(LENSL_INIT_DRIVER);
+	if (!ret)
+		ret = platform_driver_register(&lensl_driver);
+	if (ret) {
+		vdbg_printk(LENSL_ERR, "Failed to register platform driver\n");
+		goto err_wq;
+	}
+	lensl_pdev = lensl_fault(LENSL_INIT_DEVICE) ? ERR_PTR(-ENOMEM) :
+		platform_device_register_simple(LENSL_DRVR_NAME, -1, NULL, 0);
+	if (IS_ERR(lensl_pdev)) {
+		ret = PTR_ERR(lensl_pdev);
+		lensl_pdev = NULL;
+		vdbg_printk(LENSL_ERR, "Failed to register platform device\n");
+		goto err_driver;
+	}
+	/* a failed probe does not fail the registration; it has logged
+	   why */
+	if (!lensl) {
+		ret = -ENODEV;
+		goto err_pdev;
+	}
+
+	vdbg_printk(LENSL_INFO,
+		"Loaded Lenovo ThinkPad SL Series driver in %lld us\n",
+		(long long)ktime_to_us(ktime_sub(ktime_get(), start)));
+	return 0;
+
+err_pdev:
+	platform_device_unregister(lensl_pdev);
+	lensl_pdev = NULL;
+err_driver:
+	platform_driver_unregister(&lensl_driver);
+err_wq:
+	lensl_nl_exit();
+	destroy_workqueue(lensl_wq);
+	lensl_wq = NULL;
+err_key:
+	if (dbg_level >= LENSL_DEBUG)
+		lensl_debug_key_dec();
+	return ret;
+}
+
+static void __exit lenovo_sl_laptop_exit(void)
+{
+	ktime_t start = ktime_get();
+
 	if (lensl_pdev)
 		platform_device_unregister(lensl_pdev);
+	platform_driver_unregister(&lensl_driver);
+	lensl_nl_exit();
 	destroy_workqueue(lensl_wq);
-	vdbg_printk(LENSL_INFO, "Unloaded Lenovo ThinkPad SL Series driver\n");
+	if (dbg_level >= LENSL_DEBUG)
+		lensl_debug_key_dec();
+	vdbg_printk(LENSL_INFO,
+		"Unloaded Lenovo ThinkPad SL Series driver in %lld us\n",
+		(long long)ktime_to_us(ktime_sub(ktime_get(), start)));
 }
 
 MODULE_ALIAS("dmi:bvnLENOVO:*:svnLENOVO*:*:pvrThinkPad SL*:rvnLENOVO:*");
@@ -0,0 +1,207 @@
+/*
+ *  lenovo-sl-laptop.h - Lenovo ThinkPad SL Series Extras Driver,
+ *  userspace interface
+ *
+ *
+ *  Copyright (C) 2008-2009 Alexandre Rostovtsev <tetromino@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301, USA.
+ *
+ */
+
+#ifndef _LENOVO_SL_LAPTOP_H
+#define _LENOVO_SL_LAPTOP_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Driver events. The meaning of the index and value of each event is
+   given in the comment next to it. */
+enum lensl_event_type {
+	LENSL_EVENT_HOTKEY = 0,	/* EC scancode, keycode (0 if unmapped) */
+	LENSL_EVENT_WLSW,	/* 0, hardware radio switch (1 = radios on) */
+	LENSL_EVENT_RADIO,	/* radio (see below), 1 = on, 0 = soft blocked */
+	LENSL_EVENT_BACKLIGHT,	/* 0, brightness level */
+	LENSL_EVENT_FAN_MODE,	/* fan, 0 = automatic, 1 = manual */
+	LENSL_EVENT_FAN_PWM,	/* fan, pwm value (0 .. 255) */
+	LENSL_EVENT_FAN_RPM,	/* fan, speed in rpm */
+	LENSL_EVENT_LED,	/* 0, 0 = off, 1 = on, 2 = blinking */
+	LENSL_EVENT_FAN_ALARM,	/* fan, active LENSL_FAN_ALARM_* bits */
+	LENSL_EVENT_PROFILE,	/* 0, 0 = low-power, 1 = balanced,
+				   2 = performance */
+	LENSL_EVENT_ACCEL_SHOCK,	/* 0, change between samples */
+	LENSL_EVENT_HKEY_HEALTH,	/* 0, 0 = EC reads failing and
+					   polling backed off, 1 = healthy */
+};
+
+#define LENSL_FAN_ALARM_MIN	0x01	/* below fan1_min */
+#define LENSL_FAN_ALARM_MAX	0x02	/* above fan1_max */
+
+/* radio indices */
+enum lensl_radio_index {
+	LENSL_RADIO_BLUETOOTH = 0,
+	LENSL_RADIO_WWAN,
+	LENSL_RADIO_UWB,
+};
+
+/* Generic netlink event channel. Every event is multicast to the
+   LENSL_NL_MCGRP_NAME group of the LENSL_NL_FAMILY_NAME family as a
+   LENSL_NL_C_EVENT message carrying all of the attributes below. */
+#define LENSL_NL_FAMILY_NAME	"lenovo_sl"
+#define LENSL_NL_MCGRP_NAME	"events"
+#define LENSL_NL_VERSION	1
+
+enum {
+	LENSL_NL_C_UNSPEC = 0,
+	LENSL_NL_C_EVENT,
+	__LENSL_NL_C_MAX,
+};
+#define LENSL_NL_C_MAX (__LENSL_NL_C_MAX - 1)
+
+enum {
+	LENSL_NL_A_UNSPEC = 0,
+	LENSL_NL_A_EVENT,	/* u32, enum lensl_event_type */
+	LENSL_NL_A_TIMESTAMP,	/* u64, CLOCK_MONOTONIC in ns */
+	LENSL_NL_A_INDEX,	/* u32 */
+	LENSL_NL_A_VALUE,	/* u32, signed */
+	__LENSL_NL_A_MAX,
+};
+#define LENSL_NL_A_MAX (__LENSL_NL_A_MAX - 1)
+
+/* Character device /dev/lenovo-sl */
+#define LENSL_DEV_NAME		"lenovo-sl"
+
+/* controls, as used by the ioctls and the status page */
+enum lensl_ctl_id {
+	LENSL_CTL_FAN_MODE = 0,	/* rw, 0 = automatic, 1 = manual */
+	LENSL_CTL_FAN_PWM,	/* rw, 0 .. 255 */
+	LENSL_CTL_FAN_RPM,	/* ro */
+	LENSL_CTL_WLSW,		/* ro, hardware radio switch, 1 = radios on */
+	LENSL_CTL_BLUETOOTH,	/* rw, 1 = on; radios follow lensl_radio_index */
+	LENSL_CTL_WWAN,		/* rw */
+	LENSL_CTL_UWB,		/* rw */
+	LENSL_CTL_BRIGHTNESS,	/* rw, backlight level */
+	LENSL_CTL_LED,		/* rw, 0 = off, 1 = on, 2 = blinking */
+	LENSL_CTL_COUNT,
+};
+
+struct lensl_ctl {
+	__u32 id;		/* enum lensl_ctl_id */
+	__s32 value;
+	__s32 result;		/* set by the driver: 0 or -errno */
+	__u32 reserved;
+};
+
+#define LENSL_BATCH_MAX		16
+
+/* Controls are processed in order; a failing control does not stop the
+   batch, check the result of each. */
+struct lensl_batch {
+	__u32 count;
+	__u32 reserved;
+	struct lensl_ctl ctl[LENSL_BATCH_MAX];
+};
+
+#define LENSL_IOC_MAGIC		'L'
+#define LENSL_IOC_GET		_IOWR(LENSL_IOC_MAGIC, 0x01, struct lensl_batch)
+#define LENSL_IOC_SET		_IOWR(LENSL_IOC_MAGIC, 0x02, struct lensl_batch)
+
+/* Read-only status page, mmap() one page at offset 0. seq is odd while
+   the driver updates the page, so read it like a seqcount:
+
+	do {
+		seq = status->seq;
+		rmb();
+		copy = *status;
+		rmb();
+	} while ((seq & 1) || seq != status->seq);
+
+   A value of -1 means unknown or not present. */
+#define LENSL_STATUS_VERSION	1
+
+struct lensl_status {
+	__u32 seq;
+	__u32 version;
+	__u64 timestamp;	/* CLOCK_MONOTONIC in ns of the last update */
+	__s32 value[LENSL_CTL_COUNT];
+};
+
+/* Fan telemetry record, as read from
+   <debugfs>/lenovo-sl-laptop/fan_history */
+#define LENSL_FAN_SAMPLE_RPM_VALID	0x01
+#define LENSL_FAN_SAMPLE_MODE_VALID	0x02
+#define LENSL_FAN_SAMPLE_MANUAL		0x04
+#define LENSL_FAN_SAMPLE_PWM_VALID	0x08
+#define LENSL_FAN_SAMPLE_ALARM_MIN	0x10
+#define LENSL_FAN_SAMPLE_ALARM_MAX	0x20
+
+struct lensl_fan_sample {
+	__u64 timestamp;	/* CLOCK_MONOTONIC in ns */
+	__u32 seq;		/* increments by one per sample */
+	__u16 rpm;
+	__u8 pwm;
+	__u8 flags;		/* LENSL_FAN_SAMPLE_* */
+};
+
+/* Firmware access record, as read from <debugfs>/lenovo-sl-laptop/trace;
+   a file of these is a capture that can be replayed with replay=<file> */
+enum lensl_trace_type {
+	LENSL_TRACE_EC_READ = 1,	/* target = register, value = byte */
+	LENSL_TRACE_EC_WRITE,		/* target = register, value = byte */
+	LENSL_TRACE_ACPI,		/* target = LENSL_TRACE_HKEY etc. */
+};
+
+enum lensl_trace_target {
+	LENSL_TRACE_HKEY = 0,		/* methods of the EC0.HKEY device */
+	LENSL_TRACE_EC0,		/* of the EC0 device */
+	LENSL_TRACE_LCDD,		/* of the LCD device (backlight) */
+	LENSL_TRACE_BAT,		/* of the EC0.BAT0 battery */
+};
+
+#define LENSL_TRACE_RET		0x01	/* ACPI method returns value */
+
+struct lensl_trace_rec {
+	__u64 timestamp;	/* CLOCK_MONOTONIC in ns at the start */
+	__u32 duration;		/* ns */
+	__u8 type;		/* enum lensl_trace_type */
+	__u8 target;
+	__u8 argc;		/* ACPI arguments used */
+	__u8 flags;		/* LENSL_TRACE_* */
+	char method[4];		/* ACPI method name, not NUL-terminated */
+	__s32 args[3];		/* unused ones are 0 */
+	__s32 value;
+	__s32 result;		/* 0 or -errno */
+};
+
+/* Events of the "lenovo_sl" perf PMU, the value of
+   perf_event_attr.config; they count system-wide only, e.g.
+   perf stat -a -e lenovo_sl/ec_reads/ */
+#define LENSL_PMU_NAME		"lenovo_sl"
+
+enum lensl_perf_event {
+	LENSL_PERF_EC_READS = 0,	/* EC registers read */
+	LENSL_PERF_EC_WRITES,		/* EC registers written */
+	LENSL_PERF_ACPI_HKEY,		/* methods of EC0.HKEY evaluated */
+	LENSL_PERF_ACPI_EC0,		/* of EC0 and the devices below it */
+	LENSL_PERF_ACPI_LCDD,		/* of the LCD device (backlight) */
+	LENSL_PERF_HOTKEYS_DELIVERED,	/* scancodes sent as input events */
+	LENSL_PERF_HOTKEYS_SWALLOWED,	/* scancodes not sent */
+	LENSL_PERF_BACKLIGHT_CHANGES,	/* brightness level changes */
+	LENSL_PERF_FAN_RPM,		/* fan speed over time, in rpm-ms */
+	__LENSL_PERF_MAX,
+};
+
+#endif /* _LENOVO_SL_LAPTOP_H */
@@ -0,0 +1,421 @@
+/*
+ *  lensl-bench - concurrent load benchmark for lenovo-sl-laptop
+ *
+ *  Copyright (C) 2008-2009 Alexandre Rostovtsev <tetromino@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301, USA.
+ *
+ */
+
+/* Usage: lensl-bench [-r readers] [-w writers] [-t seconds] [-S]
+		      [-q settle_ms]
+
+   Runs reader and writer threads against the sysfs attributes of the
+   driver (hwmon fan1_input/pwm1/pwm1_enable, backlight, LED, rfkill)
+   and reports throughput and p50/p99/p99.9 latency per attribute and
+   operation, plus consistency violations:
+
+   - a read of pwm1 returning a value no writer ever wrote (or the
+     driver's pwm1 floor, to which lower writes are raised); readers
+     start once the first pwm1 write is done;
+   - pwm1_enable, rfkill, LED or brightness reads outside their range;
+   - at each quiescent check (all writers paused, every 100 ms), pwm1
+     not being one of the values written since the previous check, and,
+     with -S (the module loaded with simulate=1), fan1_input disagreeing
+     with pwm1 according to the simulator's fan model, i.e. the driver
+     reporting a pwm1 other than the one it last gave the firmware.
+     pwm1 writes reach the firmware up to fan_write_delay ms late, so
+     with -S the check first waits settle_ms (-q, default 100) for them
+     to settle before comparing fan1_input.
+
+   The fan is put in manual mode for the run and back in automatic mode
+   at the end. Run as root. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PLATFORM "/sys/devices/platform/lenovo-sl-laptop"
+
+enum { T_FAN1_INPUT, T_PWM1, T_PWM1_ENABLE, T_BRIGHTNESS, T_LED,
+	T_RFKILL, T_COUNT };
+
+static struct target {
+	const char *name;
+	const char *pattern;	/* glob for the attribute */
+	const char *wname;	/* attribute written instead, if any */
+	int writable;
+	char path[256], wpath[256];
+	int present;
+} targets[T_COUNT] = {
+	{ "fan1_input", PLATFORM "/{hwmon/,}hwmon*/fan1_input", NULL, 0 },
+	{ "pwm1", PLATFORM "/{hwmon/,}hwmon*/pwm1", NULL, 1 },
+	{ "pwm1_enable", PLATFORM "/{hwmon/,}hwmon*/pwm1_enable", NULL, 0 },
+	{ "brightness", "/sys/class/backlight/thinkpad_screen/brightness",
+		NULL, 1 },
+	{ "led", "/sys/class/leds/lensl::lenovocare/brightness", NULL, 1 },
+	/* the first radio; "soft" on 2.6.31 and later, "state" before */
+	{ "rfkill", PLATFORM "/{rfkill/,}rfkill*/state", "soft", 1 },
+};
+
+/* pwm1 values used by writer i are i * 16 + 8 + k for k < 8, so every
+   legitimate value is known */
+#define PWM_VALUE(w, k) (((w) * 16 + 8 + (k)) & 0xff)
+
+struct samples {
+	unsigned long *ns;
+	size_t count, size;
+	unsigned long errors;
+};
+
+struct worker {
+	pthread_t thread;
+	int id, writer;
+	struct samples s[T_COUNT][2];	/* [target][read, write] */
+};
+
+static volatile int stop;
+static pthread_rwlock_t quiesce = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t pwm_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char pwm_written[256];	/* since the last check */
+static int pwm_writes;
+/* pwm1 after switching to manual mode and after writing 0, which the
+   driver raises to its floor (fan_pwm_floor, 0 if none) */
+static long pwm_seed = -1, pwm_floor;
+static volatile int pwm_started;
+static unsigned long violations, checks;
+static int nwriters = 1, simulated, settle_ms = 100;
+static long brightness_max = -1;
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void sample(struct samples *s, unsigned long ns)
+{
+	if (s->count == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+		if (!s->ns) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->ns[s->count++] = ns;
+}
+
+static int read_attr(const char *path, long *value)
+{
+	char buf[32];
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return n < 0 ? -errno : -EIO;
+	buf[n] = 0;
+	*value = strtol(buf, NULL, 0);
+	return 0;
+}
+
+static int write_attr(const char *path, long value)
+{
+	char buf[32];
+	int fd, n, len;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	len = snprintf(buf, sizeof(buf), "%ld\n", value);
+	n = write(fd, buf, len);
+	close(fd);
+	return n == len ? 0 : -errno;
+}
+
+static void violation(const char *what, long value)
+{
+	__sync_fetch_and_add(&violations, 1);
+	fprintf(stderr, "violation: %s = %ld\n", what, value);
+}
+
+static void check_read(int t, long v)
+{
+	switch (t) {
+	case T_PWM1:
+		if (v == pwm_seed || v == pwm_floor)
+			break;
+		if ((v & 15) < 8 || (v >> 4) >= nwriters)
+			violation("pwm1 not written by anyone", v);
+		break;
+	case T_PWM1_ENABLE:
+	case T_RFKILL:
+		if (v < 0 || v > 2)
+			violation(targets[t].name, v);
+		break;
+	case T_LED:
+		if (v != 0 && v != 255)
+			violation("led", v);
+		break;
+	case T_BRIGHTNESS:
+		if (v < 0 || (brightness_max >= 0 && v > brightness_max))
+			violation("brightness", v);
+		break;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long start, k = 0;
+	long v;
+	int t, res;
+
+	/* until a writer has set pwm1, it holds whatever was there */
+	while (!w->writer && !stop && !pwm_started)
+		usleep(1000);
+	while (!stop) {
+		for (t = 0; t < T_COUNT && !stop; t++) {
+			if (!targets[t].present)
+				continue;
+			if (!w->writer) {
+				start = now_ns();
+				res = read_attr(targets[t].path, &v);
+				sample(&w->s[t][0], now_ns() - start);
+				if (res)
+					w->s[t][0].errors++;
+				else
+					check_read(t, v);
+				continue;
+			}
+			if (!targets[t].writable)
+				continue;
+			switch (t) {
+			case T_PWM1:
+				v = PWM_VALUE(w->id, k % 8);
+				break;
+			case T_LED:
+				v = (k & 1) ? 255 : 0;
+				break;
+			case T_RFKILL:
+				v = k & 1;
+				break;
+			default:
+				v = brightness_max > 0 ?
+					(long)(k % (brightness_max + 1)) : 0;
+			}
+			pthread_rwlock_rdlock(&quiesce);
+			start = now_ns();
+			res = write_attr(targets[t].wpath, v);
+			sample(&w->s[t][1], now_ns() - start);
+			if (res)
+				w->s[t][1].errors++;
+			else if (t == T_PWM1) {
+				pthread_mutex_lock(&pwm_lock);
+				pwm_written[v < pwm_floor ? pwm_floor : v] = 1;
+				pwm_writes++;
+				pthread_mutex_unlock(&pwm_lock);
+				pwm_started = 1;
+			}
+			pthread_rwlock_unlock(&quiesce);
+		}
+		k++;
+	}
+	return NULL;
+}
+
+/* with all writers paused, the state reported by the driver must be
+   the outcome of one of the writes since the previous check */
+static void quiescent_check(void)
+{
+	long pwm, rpm;
+
+	pthread_rwlock_wrlock(&quiesce);
+	checks++;
+	if (targets[T_PWM1].present && pwm_writes &&
+	    !read_attr(targets[T_PWM1].path, &pwm)) {
+		if (pwm < 0 || pwm > 255 || !pwm_written[pwm])
+			violation("pwm1 not written since last check", pwm);
+		/* the simulator runs the fan at pwm * 2700 / 126 rpm */
+		if (simulated && settle_ms)
+			usleep(settle_ms * 1000);
+		if (simulated && !read_attr(targets[T_FAN1_INPUT].path, &rpm) &&
+		    rpm != pwm * 2700 / 126)
+			violation("fan1_input does not follow pwm1", rpm);
+	}
+	memset(pwm_written, 0, sizeof(pwm_written));
+	pwm_writes = 0;
+	pthread_rwlock_unlock(&quiesce);
+}
+
+static int cmp_ul(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(struct samples *s, double p)
+{
+	size_t i = (size_t)(p * (s->count - 1));
+
+	return s->ns[i] / 1000.0;
+}
+
+static void discover(void)
+{
+	glob_t g;
+	int t;
+
+	char *slash;
+
+	for (t = 0; t < T_COUNT; t++) {
+		if (glob(targets[t].pattern, GLOB_BRACE, NULL, &g))
+			continue;
+		snprintf(targets[t].path, sizeof(targets[t].path), "%s",
+			g.gl_pathv[0]);
+		globfree(&g);
+		targets[t].present = !access(targets[t].path, R_OK);
+		strcpy(targets[t].wpath, targets[t].path);
+		slash = strrchr(targets[t].wpath, '/');
+		if (targets[t].wname && slash) {
+			strcpy(slash + 1, targets[t].wname);
+			if (access(targets[t].wpath, W_OK))
+				strcpy(targets[t].wpath, targets[t].path);
+		}
+	}
+	if (targets[T_BRIGHTNESS].present)
+		read_attr("/sys/class/backlight/thinkpad_screen/max_brightness",
+			&brightness_max);
+}
+
+int main(int argc, char **argv)
+{
+	int readers = 4, seconds = 10, opt, i, t, op;
+	char enable[256] = "";
+	struct samples all;
+	struct worker *w;
+	double secs;
+	unsigned long start;
+
+	while ((opt = getopt(argc, argv, "r:w:t:Sq:")) != -1) {
+		switch (opt) {
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'w':
+			nwriters = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'S':
+			simulated = 1;
+			break;
+		case 'q':
+			settle_ms = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r readers] [-w writers] "
+				"[-t seconds] [-S] [-q settle_ms]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (nwriters > 16)
+		nwriters = 16;
+
+	discover();
+	for (t = 0, i = 0; t < T_COUNT; t++)
+		i += targets[t].present;
+	if (!i) {
+		fprintf(stderr, "lenovo-sl-laptop attributes not found\n");
+		return 1;
+	}
+	/* pwm1_enable is set once here, not by the writers */
+	if (targets[T_PWM1_ENABLE].present) {
+		strcpy(enable, targets[T_PWM1_ENABLE].path);
+		if (write_attr(enable, 1))
+			fprintf(stderr, "cannot set manual fan mode\n");
+	}
+	if (targets[T_PWM1].present) {
+		read_attr(targets[T_PWM1].path, &pwm_seed);
+		if (!write_attr(targets[T_PWM1].path, 0))
+			read_attr(targets[T_PWM1].path, &pwm_floor);
+	}
+	/* nothing to wait for without pwm1 writers */
+	if (!targets[T_PWM1].present || !nwriters)
+		pwm_started = 1;
+
+	w = calloc(readers + nwriters, sizeof(*w));
+	for (i = 0; i < readers + nwriters; i++) {
+		w[i].writer = i >= readers;
+		w[i].id = i - readers;
+		pthread_create(&w[i].thread, NULL, worker_main, &w[i]);
+	}
+	start = now_ns();
+	for (i = 0; i < seconds * 10; i++) {
+		usleep(100000);
+		quiescent_check();
+	}
+	stop = 1;
+	for (i = 0; i < readers + nwriters; i++)
+		pthread_join(w[i].thread, NULL);
+	secs = (now_ns() - start) / 1e9;
+	quiescent_check();
+	if (enable[0])
+		write_attr(enable, 0);
+
+	printf("%d readers, %d writers, %.1f s\n", readers, nwriters, secs);
+	printf("%-12s %-5s %10s %10s %10s %10s %10s %8s\n", "attribute", "op",
+		"ops", "ops/s", "p50_us", "p99_us", "p999_us", "errors");
+	for (t = 0; t < T_COUNT; t++) {
+		for (op = 0; op < 2; op++) {
+			memset(&all, 0, sizeof(all));
+			for (i = 0; i < readers + nwriters; i++) {
+				struct samples *s = &w[i].s[t][op];
+				size_t n;
+
+				for (n = 0; n < s->count; n++)
+					sample(&all, s->ns[n]);
+				all.errors += s->errors;
+			}
+			if (!all.count)
+				continue;
+			qsort(all.ns, all.count, sizeof(*all.ns), cmp_ul);
+			printf("%-12s %-5s %10zu %10.0f %10.1f %10.1f %10.1f "
+				"%8lu\n", targets[t].name, op ? "write" : "read",
+				all.count, all.count / secs, pct(&all, 0.50),
+				pct(&all, 0.99), pct(&all, 0.999), all.errors);
+			free(all.ns);
+		}
+	}
+	printf("consistency violations: %lu (%lu quiescent checks)\n",
+		violations, checks);
+	return violations ? 3 : 0;
+}
@@ -0,0 +1,168 @@
+#!/bin/sh
+#
+#  lensl-soak - load and unload lenovo-sl-laptop repeatedly
+#
+#  Copyright (C) 2008-2009 Alexandre Rostovtsev <tetromino@gmail.com>
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+#  02110-1301, USA.
+#
+
+# Usage: lensl-soak.sh [-n cycles] [-m module.ko] [module options...]
+#
+# Loads the module against the simulated firmware (simulate=1, with the
+# procfs interface, a trace ring and the EC battery) and unloads it
+# again, cycles times (default 1000). Cycle i loads with fault_init=i
+# modulo the number of init steps + 1, so every error path of the init
+# is taken in turn, and cycle 0 of each round loads without a fault.
+# The simulator never sets up the backlight, nor the accelerometer
+# unless accel_reg is given, so their steps fail nothing and their
+# error paths are not covered here. After each unload, it checks that
+# no thread, sysfs, procfs, debugfs or device node, power supply, PMU,
+# input device or vmalloc area of the driver is left. With kmemleak
+# enabled, it compares the number of unreferenced objects reported
+# before and after the run; leaks of the module can no longer be told
+# apart by name once it is unloaded, so run it on an otherwise idle
+# system.
+# Prints the load and unload time distribution (wall time of insmod and
+# rmmod) and exits with 3 if anything leaked or a load without a fault
+# failed. Run as root, with the module not loaded.
+
+MODULE=lenovo-sl-laptop
+KO=./$MODULE.ko
+CYCLES=1000
+
+while getopts n:m: opt; do
+	case $opt in
+	n) CYCLES=$OPTARG ;;
+	m) KO=$OPTARG ;;
+	*) echo "usage: $0 [-n cycles] [-m module.ko] [module options...]" >&2
+	   exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+OPTS="simulate=1 debug_ec=1 trace_size=64 battery_reg=0xc0 $*"
+
+if [ ! -f "$KO" ]; then
+	echo "$KO not found; run make first" >&2
+	exit 1
+fi
+if grep -q "^lenovo_sl_laptop " /proc/modules; then
+	echo "$MODULE is loaded; unload it first" >&2
+	exit 1
+fi
+STEPS=$(modinfo -F parm "$KO" |
+	sed -n 's/^fault_init:.*step 1-\([0-9]*\).*/\1/p')
+if [ -z "$STEPS" ]; then
+	echo "$KO has no fault_init parameter" >&2
+	exit 1
+fi
+
+# objects must be unreferenced for a while and seen by two scans before
+# kmemleak reports them
+kmemleak_count() {
+	echo scan > $KMEMLEAK
+	sleep 6
+	echo scan > $KMEMLEAK
+	grep -c '^unreferenced object' $KMEMLEAK
+}
+
+KMEMLEAK=/sys/kernel/debug/kmemleak
+if [ -w $KMEMLEAK ]; then
+	echo clear > $KMEMLEAK
+	kmemleak_before=$(kmemleak_count)
+else
+	echo "kmemleak not available; memory leaks are not checked" >&2
+	KMEMLEAK=
+fi
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+leaks=0
+failed=0
+
+now_us() {
+	echo $(($(date +%s%N) / 1000))
+}
+
+# everything the driver creates, one line each, empty when unloaded
+leftovers() {
+	ps -e -o comm= | grep '^klensl'
+	for f in /sys/devices/platform/$MODULE /proc/acpi/$MODULE \
+		/sys/kernel/debug/$MODULE /dev/lenovo-sl \
+		/sys/class/backlight/thinkpad_screen \
+		/sys/class/power_supply/lensl_battery \
+		/sys/bus/event_source/devices/lenovo_sl; do
+		[ -e $f ] && echo $f
+	done
+	grep -l '^lensl' /sys/class/rfkill/*/name 2>/dev/null
+	grep 'Name=.*Lenovo ThinkPad SL' /proc/bus/input/devices
+	grep '\[lenovo_sl_laptop\]' /proc/vmallocinfo 2>/dev/null
+}
+
+i=0
+while [ $i -lt "$CYCLES" ]; do
+	fault=$((i % (STEPS + 1)))
+	t0=$(now_us)
+	insmod "$KO" $OPTS fault_init=$fault 2>/dev/null
+	rc=$?
+	t1=$(now_us)
+	echo $((t1 - t0)) >> "$TMP/load"
+	if [ $rc -eq 0 ]; then
+		rmmod $MODULE
+		t2=$(now_us)
+		echo $((t2 - t1)) >> "$TMP/unload"
+	elif [ $fault -eq 0 ]; then
+		echo "cycle $i: load without a fault failed" >&2
+		failed=$((failed + 1))
+	fi
+	left=$(leftovers)
+	if [ -n "$left" ]; then
+		echo "cycle $i (fault_init=$fault): left behind:" >&2
+		echo "$left" | sed 's/^/  /' >&2
+		leaks=$((leaks + 1))
+		# start the next cycle from a clean state if possible
+		rmmod $MODULE 2>/dev/null
+	fi
+	i=$((i + 1))
+done
+
+# min, p50, p99, max of a file of numbers, in us
+dist() {
+	sort -n "$1" | awk -v name="$2" '
+		{ v[NR] = $1 }
+		END {
+			if (!NR) { printf "%-8s no samples\n", name; exit }
+			printf "%-8s %6d %10d %10d %10d %10d\n", name, NR,
+				v[1], v[int((NR - 1) * 0.5) + 1],
+				v[int((NR - 1) * 0.99) + 1], v[NR]
+		}'
+}
+
+printf '%-8s %6s %10s %10s %10s %10s\n' "" runs min_us p50_us p99_us max_us
+dist "$TMP/load" load
+[ -f "$TMP/unload" ] && dist "$TMP/unload" unload
+
+if [ -n "$KMEMLEAK" ]; then
+	n=$(($(kmemleak_count) - kmemleak_before))
+	if [ "$n" -gt 0 ]; then
+		echo "kmemleak: $n new unreferenced objects, see $KMEMLEAK" >&2
+		leaks=$((leaks + 1))
+	fi
+fi
+
+echo "$CYCLES cycles, $leaks with leftovers, $failed failed loads"
+[ $leaks -eq 0 ] && [ $failed -eq 0 ] || exit 3
+exit 0
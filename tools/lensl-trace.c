@@ -0,0 +1,154 @@
+/*
+ *  lensl-trace - print and summarize lenovo-sl-laptop firmware captures
+ *
+ *  Copyright (C) 2008-2009 Alexandre Rostovtsev <tetromino@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ *  02110-1301, USA.
+ *
+ */
+
+/* Usage: lensl-trace [-s] [capture]
+
+   Reads struct lensl_trace_rec records, as drained from
+   <debugfs>/lenovo-sl-laptop/trace, from the capture file or stdin and
+   prints one line per access. With -s, prints instead the number of
+   calls and the mean and maximum duration per ACPI method and EC
+   register, which is what to compare between driver versions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../lenovo-sl-laptop.h"
+
+static const char *targets[] = { "HKEY", "EC0", "LCDD", "BAT0" };
+#define TARGETS		(sizeof(targets) / sizeof(targets[0]))
+
+/* one summary slot per EC register and direction, then per ACPI method */
+#define EC_SLOTS	512
+#define MAX_SLOTS	(EC_SLOTS + 64)
+
+static struct {
+	char name[16];
+	unsigned long calls, errors;
+	unsigned long long ns, max_ns;
+} slots[MAX_SLOTS];
+static int acpi_slots;
+
+static int slot_of(const struct lensl_trace_rec *rec)
+{
+	char name[16];
+	int i;
+
+	if (rec->type != LENSL_TRACE_ACPI) {
+		i = (rec->type == LENSL_TRACE_EC_WRITE) * 256 + rec->target;
+		snprintf(slots[i].name, sizeof(slots[i].name), "ec %s 0x%02x",
+			rec->type == LENSL_TRACE_EC_WRITE ? "wr" : "rd",
+			rec->target);
+		return i;
+	}
+	snprintf(name, sizeof(name), "%s.%.4s",
+		rec->target < TARGETS ? targets[rec->target] : "?", rec->method);
+	for (i = EC_SLOTS; i < EC_SLOTS + acpi_slots; i++)
+		if (!strcmp(slots[i].name, name))
+			return i;
+	if (i == MAX_SLOTS)
+		return -1;
+	strcpy(slots[i].name, name);
+	acpi_slots++;
+	return i;
+}
+
+static void print_rec(const struct lensl_trace_rec *rec)
+{
+	int i;
+
+	printf("%llu.%09llu %7u ns ",
+		(unsigned long long)rec->timestamp / 1000000000,
+		(unsigned long long)rec->timestamp % 1000000000,
+		rec->duration);
+	switch (rec->type) {
+	case LENSL_TRACE_EC_READ:
+		printf("ec read  0x%02x = 0x%02x", rec->target, rec->value);
+		break;
+	case LENSL_TRACE_EC_WRITE:
+		printf("ec write 0x%02x = 0x%02x", rec->target, rec->value);
+		break;
+	case LENSL_TRACE_ACPI:
+		printf("%s.%.4s(",
+			rec->target < TARGETS ? targets[rec->target] : "?",
+			rec->method);
+		for (i = 0; i < rec->argc && i < 3; i++)
+			printf(i ? ", %d" : "%d", rec->args[i]);
+		printf(")");
+		if (rec->flags & LENSL_TRACE_RET)
+			printf(" = %d", rec->value);
+		break;
+	default:
+		printf("unknown record type %d", rec->type);
+	}
+	if (rec->result)
+		printf(" failed: %d", rec->result);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct lensl_trace_rec rec;
+	FILE *f = stdin;
+	int opt, summary = 0, i;
+
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		if (opt != 's') {
+			fprintf(stderr, "usage: %s [-s] [capture]\n", argv[0]);
+			return 2;
+		}
+		summary = 1;
+	}
+	if (optind < argc && !(f = fopen(argv[optind], "rb"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (!summary) {
+			print_rec(&rec);
+			continue;
+		}
+		i = slot_of(&rec);
+		if (i < 0)
+			continue;
+		slots[i].calls++;
+		slots[i].errors += !!rec.result;
+		slots[i].ns += rec.duration;
+		if (rec.duration > slots[i].max_ns)
+			slots[i].max_ns = rec.duration;
+	}
+
+	if (summary) {
+		printf("%-16s %10s %8s %10s %10s\n",
+			"access", "calls", "errors", "mean_ns", "max_ns");
+		for (i = 0; i < MAX_SLOTS; i++)
+			if (slots[i].calls)
+				printf("%-16s %10lu %8lu %10llu %10llu\n",
+					slots[i].name, slots[i].calls,
+					slots[i].errors,
+					slots[i].ns / slots[i].calls,
+					slots[i].max_ns);
+	}
+	return 0;
+}